@@ -0,0 +1,357 @@
+/* Times render_draw on the memory renderer, for a few kinds of screen updates.
+ *
+ * Every frame feeds the terminal some output, then draws whatever it damaged.
+ * The renderer's operations are timed on their own, so the report splits a
+ * frame into walking the damage (including working out styles and runs),
+ * drawing spans of text, fills, image tiles and submitting refreshes. Run
+ * with -c to start every frame with an empty glyph cache, so the span times
+ * include rasterizing the glyphs too. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "render.h"
+#include "term.h"
+#include "x.h"
+
+/* The parts of a frame that are timed on their own. */
+enum {
+	PART_SPAN,
+	PART_FILL,
+	PART_TILE,
+	PART_REFRESH,
+	PART_COUNT,
+};
+
+static const char *part_names[PART_COUNT] = { "span", "fill", "tile", "refresh" };
+
+/* The renderer's own operations, which the timed ones call. */
+static struct renderer ops;
+
+/* Nanoseconds spent in each part in the current frame. */
+static uint64_t part_ns[PART_COUNT];
+
+static struct term term;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+timed_span(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+	uint64_t t = now_ns();
+	ops.draw_span(r, row, col, text, n, fg, bg);
+	part_ns[PART_SPAN] += now_ns() - t;
+}
+
+static void
+timed_fill(struct renderer *r, int x, int y, int w, int h, uint32_t color)
+{
+	uint64_t t = now_ns();
+	ops.fill_rect(r, x, y, w, h, color);
+	part_ns[PART_FILL] += now_ns() - t;
+}
+
+static void
+timed_tile(struct renderer *r, int row, int col, const uint8_t *tile, int invert)
+{
+	uint64_t t = now_ns();
+	ops.draw_tile(r, row, col, tile, invert);
+	part_ns[PART_TILE] += now_ns() - t;
+}
+
+static uint32_t
+timed_refresh(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	uint64_t t = now_ns();
+	uint32_t marker = ops.refresh(r, x, y, w, h, flags);
+	part_ns[PART_REFRESH] += now_ns() - t;
+	return marker;
+}
+
+static struct renderer *
+renderer_new(void)
+{
+	struct renderer *r = render_mem_new(term.rows, term.cols, term.cw, term.ch);
+	if (!r)
+		die("failed to create a renderer\n");
+
+	ops = *r;
+	r->draw_span = timed_span;
+	r->fill_rect = timed_fill;
+	r->draw_tile = timed_tile;
+	r->refresh = timed_refresh;
+	return r;
+}
+
+static void
+put(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	// Everything written here is complete, so it is all taken at once.
+	term_write(&term, (unsigned char *)buf, n);
+}
+
+static uint32_t seed = 1;
+
+/* xorshift, so every run does the same thing. */
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/** Fills every row with text that is different in every frame. */
+static void
+fill_text(int frame)
+{
+	put("\033[H");
+	for (int y = 0; y < term.rows; ++y) {
+		put("\033[%dH", y+1);
+		for (int x = 0; x < term.cols; ++x)
+			put("%c", '!' + (frame+x+y) % 94);
+	}
+}
+
+/* Each scenario has an untimed setup for every frame, then what is timed. */
+
+static void
+full_step(int frame)
+{
+	fill_text(frame);
+}
+
+static void
+sparse_step(int frame)
+{
+	// About what typing and a status line or two do.
+	for (int i = 0; i < 16; ++i)
+		put("\033[%d;%dH%c", rnd() % term.rows + 1, rnd() % term.cols + 1, 'a' + rnd() % 26);
+}
+
+static void
+scroll_setup(int frame)
+{
+	if (frame == 0)
+		fill_text(0);
+}
+
+static void
+scroll_step(int frame)
+{
+	put("\033[%dH\n", term.rows);
+	for (int x = 0; x < term.cols; ++x)
+		put("%c", '!' + (frame+x) % 94);
+}
+
+static void
+clear_setup(int frame)
+{
+	fill_text(frame);
+}
+
+static void
+clear_step(int frame)
+{
+	put("\033[2J");
+}
+
+static void
+wide_step(int frame)
+{
+	put("\033[H");
+	for (int y = 0; y < term.rows; ++y) {
+		put("\033[%dH", y+1);
+		for (int x = 0; x+1 < term.cols; x += 2) {
+			unsigned char *c = utf8_encode(0x4E00 + (frame+x+y) % 0x5000, NULL);
+			put("%s", (char *)c);
+		}
+	}
+}
+
+static void
+styles_step(int frame)
+{
+	// A different style for every cell defeats merging them into runs.
+	put("\033[H");
+	for (int y = 0; y < term.rows; ++y) {
+		put("\033[%dH", y+1);
+		for (int x = 0; x < term.cols; ++x) {
+			int n = frame+x+y;
+			put("\033[0;%s38;5;%d;48;5;%dm%c", n % 5 ? "" : "7;", n % 256, (n*7) % 256, '!' + n % 94);
+		}
+	}
+	put("\033[0m");
+}
+
+static const struct scenario {
+	const char *name;
+	void (*setup)(int frame);
+	void (*step)(int frame);
+} scenarios[] = {
+	{ "full", NULL, full_step },
+	{ "sparse", NULL, sparse_step },
+	{ "scroll", scroll_setup, scroll_step },
+	{ "clear", clear_setup, clear_step },
+	{ "wide", NULL, wide_step },
+	{ "styles", NULL, styles_step },
+};
+
+/** Returns how many cells are marked as damaged. */
+static int
+damaged(void)
+{
+	int n = 0;
+	for (int i = 0; i < DAMAGE_LEN(&term); ++i)
+		n += __builtin_popcount(term.damage[i]);
+	return n;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Returns the pth percentile of n sorted samples. */
+static uint64_t
+percentile(const uint64_t *v, int n, int p)
+{
+	return v[(n-1) * p / 100];
+}
+
+static void
+run(const struct scenario *s, int frames, int cold)
+{
+	uint64_t *frame_ns = xmalloc(frames * sizeof(*frame_ns));
+	uint64_t *cell_ns = xmalloc(frames * sizeof(*cell_ns));
+	uint64_t parts[PART_COUNT] = {0}, walk = 0;
+	long cells = 0;
+
+	// Start from a blank screen that is already drawn.
+	struct renderer *r = renderer_new();
+	put("\033[0m\033[2J\033[H");
+	render_draw(r, &term);
+	seed = 1;
+
+	for (int i = 0; i < frames; ++i) {
+		if (s->setup) {
+			s->setup(i);
+			render_draw(r, &term);
+		}
+		if (cold) {
+			r->free(r);
+			r = renderer_new();
+		}
+
+		s->step(i);
+		int n = damaged();
+
+		memset(part_ns, 0, sizeof(part_ns));
+		uint64_t t = now_ns();
+		render_draw(r, &term);
+		frame_ns[i] = now_ns() - t;
+
+		uint64_t spent = 0;
+		for (int j = 0; j < PART_COUNT; ++j) {
+			parts[j] += part_ns[j];
+			spent += part_ns[j];
+		}
+		walk += frame_ns[i] > spent ? frame_ns[i] - spent : 0;
+
+		cell_ns[i] = n ? frame_ns[i] / n : 0;
+		cells += n;
+	}
+	r->free(r);
+
+	qsort(frame_ns, frames, sizeof(*frame_ns), cmp_u64);
+	qsort(cell_ns, frames, sizeof(*cell_ns), cmp_u64);
+
+	printf("%-8s %7ld %7.1f %7.1f %7.1f %7.1f %6lu %6lu %6lu", s->name,
+		cells / frames,
+		percentile(frame_ns, frames, 50) / 1e3,
+		percentile(frame_ns, frames, 90) / 1e3,
+		percentile(frame_ns, frames, 99) / 1e3,
+		frame_ns[frames-1] / 1e3,
+		(unsigned long)percentile(cell_ns, frames, 50),
+		(unsigned long)percentile(cell_ns, frames, 90),
+		(unsigned long)percentile(cell_ns, frames, 99));
+	printf(" %7.1f", walk / 1e3 / frames);
+	for (int j = 0; j < PART_COUNT; ++j)
+		printf(" %7.1f", parts[j] / 1e3 / frames);
+	putchar('\n');
+
+	free(frame_ns);
+	free(cell_ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int frames = 200, rows = 105, cols = 158, cold = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "cn:s:")) != -1) {
+		switch (opt) {
+		case 'c': cold = 1; break;
+		case 'n': frames = atoi(optarg); break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &rows, &cols) != 2)
+				optind = argc+1;
+			break;
+		default: optind = argc+1; break;
+		}
+	}
+
+	if (optind > argc || frames < 1 || rows < 1 || cols < 2)
+		die("usage: %s [-c] [-n frames] [-s rowsxcols] [scenario...]\n", argc ? argv[0] : "./bench");
+
+	int slave;
+	if (term_init(&term, rows, cols, &slave) == -1)
+		die("term_init: %s\n", strerror(errno));
+
+	printf("%d frames of %dx%d cells%s\n", frames, rows, cols, cold ? ", cold glyph cache" : "");
+	printf("%-8s %7s %7s %7s %7s %7s %6s %6s %6s %7s", "", "cells", "p50", "p90", "p99", "max",
+		"p50", "p90", "p99", "walk");
+	for (int j = 0; j < PART_COUNT; ++j)
+		printf(" %7s", part_names[j]);
+	printf("\n%-8s %7s %31s %20s %39s\n", "", "/frame", "us/frame", "ns/cell", "mean us/frame");
+
+	if (optind == argc) {
+		for (size_t i = 0; i < ARRAYLEN(scenarios); ++i)
+			run(&scenarios[i], frames, cold);
+	}
+
+	for (int j = optind; j < argc; ++j) {
+		size_t i = 0;
+		while (i < ARRAYLEN(scenarios) && strcmp(argv[j], scenarios[i].name))
+			++i;
+		if (i == ARRAYLEN(scenarios))
+			die("unknown scenario %s\n", argv[j]);
+		run(&scenarios[i], frames, cold);
+	}
+
+	term_free(&term);
+	close(slave);
+}
@@ -0,0 +1,342 @@
+#include <string.h>
+
+#include "boxdraw.h"
+
+/* Weights of the lines coming out of the middle of a cell. */
+enum { NONE, LIGHT, HEAVY, DOUBLE };
+
+/* The weights of the up, right, down and left arms of every box drawing
+ * character. Dashed lines, arcs and diagonals are left empty and drawn
+ * separately. */
+static const char *arms[0x80] = {
+	"0101", "0202", "1010", "2020", /* ─ ━ │ ┃ */
+	"", "", "", "",                 /* ┄ ┅ ┆ ┇ */
+	"", "", "", "",                 /* ┈ ┉ ┊ ┋ */
+	"0110", "0210", "0120", "0220", /* ┌ ┍ ┎ ┏ */
+	"0011", "0012", "0021", "0022", /* ┐ ┑ ┒ ┓ */
+	"1100", "1200", "2100", "2200", /* └ ┕ ┖ ┗ */
+	"1001", "1002", "2001", "2002", /* ┘ ┙ ┚ ┛ */
+	"1110", "1210", "2110", "1120", /* ├ ┝ ┞ ┟ */
+	"2120", "2210", "1220", "2220", /* ┠ ┡ ┢ ┣ */
+	"1011", "1012", "2011", "1021", /* ┤ ┥ ┦ ┧ */
+	"2021", "2012", "1022", "2022", /* ┨ ┩ ┪ ┫ */
+	"0111", "0112", "0211", "0212", /* ┬ ┭ ┮ ┯ */
+	"0121", "0122", "0221", "0222", /* ┰ ┱ ┲ ┳ */
+	"1101", "1102", "1201", "1202", /* ┴ ┵ ┶ ┷ */
+	"2101", "2102", "2201", "2202", /* ┸ ┹ ┺ ┻ */
+	"1111", "1112", "1211", "1212", /* ┼ ┽ ┾ ┿ */
+	"2111", "1121", "2121", "2112", /* ╀ ╁ ╂ ╃ */
+	"2211", "1122", "1221", "2212", /* ╄ ╅ ╆ ╇ */
+	"1222", "2122", "2221", "2222", /* ╈ ╉ ╊ ╋ */
+	"", "", "", "",                 /* ╌ ╍ ╎ ╏ */
+	"0303", "3030", "0310", "0130", /* ═ ║ ╒ ╓ */
+	"0330", "0013", "0031", "0033", /* ╔ ╕ ╖ ╗ */
+	"1300", "3100", "3300", "1003", /* ╘ ╙ ╚ ╛ */
+	"3001", "3003", "1310", "3130", /* ╜ ╝ ╞ ╟ */
+	"3330", "1013", "3031", "3033", /* ╠ ╡ ╢ ╣ */
+	"0313", "0131", "0333", "1303", /* ╤ ╥ ╦ ╧ */
+	"3101", "3303", "1313", "3131", /* ╨ ╩ ╪ ╫ */
+	"3333", "", "", "",             /* ╬ ╭ ╮ ╯ */
+	"", "", "", "",                 /* ╰ ╱ ╲ ╳ */
+	"0001", "1000", "0100", "0010", /* ╴ ╵ ╶ ╷ */
+	"0002", "2000", "0200", "0020", /* ╸ ╹ ╺ ╻ */
+	"0201", "1020", "0102", "2010", /* ╼ ╽ ╾ ╿ */
+};
+
+/* Quadrants of U+2596...U+259F: upper left, upper right, lower left and lower
+ * right are bits 0 to 3. */
+static const uint8_t quadrants[10] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+
+/* Everything needed to draw lines in a cell.
+ * Drawing is done as if the arms being drawn are horizontal; vertical ones
+ * are drawn with the cell flipped over its diagonal, see put. */
+struct box {
+	uint8_t *mask;
+	int cw, ch;
+	int flip;
+
+	/** Size of the cell and the middle of it, as seen while drawing. */
+	int w, h, mx, my;
+
+	/** Thickness of light and heavy lines, and how far each line of a
+	 * double line is from the middle. */
+	int t1, t2, g;
+};
+
+static inline int
+clamp(int v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/** Sets the pixels between x0...x1 and y0...y1 (exclusive) as seen while
+ * drawing. */
+static void
+put(struct box *b, int x0, int y0, int x1, int y1, uint8_t v)
+{
+	if (b->flip) {
+		int t;
+		t = x0; x0 = y0; y0 = t;
+		t = x1; x1 = y1; y1 = t;
+	}
+
+	x0 = clamp(x0, 0, b->cw); x1 = clamp(x1, 0, b->cw);
+	y0 = clamp(y0, 0, b->ch); y1 = clamp(y1, 0, b->ch);
+
+	for (int y = y0; y < y1; ++y)
+		memset(&b->mask[y*b->cw + x0], v, x1 > x0 ? x1-x0 : 0);
+}
+
+static void
+orient(struct box *b, int flip)
+{
+	b->flip = flip;
+	b->w = flip ? b->ch : b->cw;
+	b->h = flip ? b->cw : b->ch;
+	b->mx = b->w/2;
+	b->my = b->h/2;
+}
+
+static inline int
+thick(struct box *b, int weight)
+{
+	return weight == HEAVY ? b->t2 : weight ? b->t1 : 0;
+}
+
+/** Returns how wide a line of weight is, including both lines of a double. */
+static inline int
+span(struct box *b, int weight)
+{
+	return weight == DOUBLE ? 2*b->g + b->t1 : thick(b, weight);
+}
+
+/** Returns where a line of thickness t centered on c starts. */
+static inline int
+edge(int c, int t)
+{
+	return c - t/2;
+}
+
+/** Draws the left and right arms of a cell, with weights l and r, that meet
+ * up and down arms with weights u and d. */
+static void
+horizontal(struct box *b, int u, int r, int d, int l)
+{
+	int mx = b->mx, my = b->my, g = b->g, t1 = b->t1;
+
+	for (int side = 0; side < 2; ++side) {
+		int w = side ? r : l, other = side ? l : r;
+		if (!w)
+			continue;
+
+		// x0 is where the arm starts if it's the right one, and x1 is
+		// where it stops if it's the left one.
+		int x0, x1;
+
+		if (w != DOUBLE) {
+			int t = thick(b, w), y = edge(my, t);
+
+			if (u != DOUBLE && d != DOUBLE) {
+				// Go all the way through whatever is crossing,
+				// so the two meet up without a notch.
+				int T = span(b, u) > span(b, d) ? span(b, u) : span(b, d);
+				if (T < t) T = t;
+				x0 = edge(mx, T);
+				x1 = x0 + T;
+			} else if (other || u != d) {
+				// Crossing a double line, or turning into one:
+				// reach the far line.
+				x0 = edge(mx-g, t1);
+				x1 = edge(mx+g, t1) + t1;
+			} else {
+				// Stop at the near line of a double that goes
+				// straight through.
+				x0 = edge(mx+g, t1);
+				x1 = edge(mx-g, t1) + t1;
+			}
+
+			if (side)
+				put(b, x0, y, b->w, y+t, 0xFF);
+			else
+				put(b, 0, y, x1, y+t, 0xFF);
+			continue;
+		}
+
+		// Double lines are two light lines, which each stop at the
+		// line on their side of the middle, or go around the corner if
+		// there isn't one.
+		for (int top = 0; top < 2; ++top) {
+			int p = top ? u : d, q = top ? d : u;
+			int y = edge(top ? my-g : my+g, t1);
+
+			if (p == DOUBLE) {
+				x0 = edge(mx+g, t1);
+				x1 = edge(mx-g, t1) + t1;
+			} else if (p || (q && q != DOUBLE)) {
+				int t = thick(b, p ? p : q);
+				x0 = edge(mx, t);
+				x1 = x0 + t;
+			} else {
+				x0 = edge(mx-g, t1);
+				x1 = edge(mx+g, t1) + t1;
+			}
+
+			if (side)
+				put(b, x0, y, b->w, y+t1, 0xFF);
+			else
+				put(b, 0, y, x1, y+t1, 0xFF);
+		}
+	}
+}
+
+/** Draws a horizontal line of weight broken up into n dashes. */
+static void
+dashes(struct box *b, int weight, int n)
+{
+	int t = thick(b, weight), y = edge(b->my, t);
+	int gap = b->w / (2*n) ? b->w / (2*n) : 1;
+
+	for (int i = 0; i < n; ++i) {
+		int x0 = i*b->w/n, x1 = (i+1)*b->w/n - gap;
+		put(b, x0 + gap/2, y, x1 + gap/2, y+t, 0xFF);
+	}
+}
+
+/** Draws a light rounded corner with arms going right if sx is 1 or left if it
+ * is -1, and down if sy is 1 or up if it is -1. */
+static void
+arc(struct box *b, int sx, int sy)
+{
+	int t = b->t1;
+	int r = (b->cw < b->ch ? b->cw : b->ch) / 2;
+
+	// The middle of the lines the arc joins up with.
+	double lx = edge(b->mx, t) + t/2.0, ly = edge(b->my, t) + t/2.0;
+	double cx = lx + sx*r, cy = ly + sy*r;
+	double in = r - t/2.0, out = r + t/2.0;
+
+	for (int y = 0; y < b->ch; ++y) {
+		for (int x = 0; x < b->cw; ++x) {
+			double dx = x + 0.5 - cx, dy = y + 0.5 - cy;
+			if (dx*sx > 0 || dy*sy > 0)
+				continue;
+
+			double d2 = dx*dx + dy*dy;
+			if (d2 >= in*in && d2 <= out*out)
+				b->mask[y*b->cw + x] = 0xFF;
+		}
+	}
+
+	// Straight on from the ends of the arc to the edges of the cell.
+	int x = edge(b->mx, t), y = edge(b->my, t);
+	if (sy > 0)
+		put(b, x, (int)cy, x+t, b->ch, 0xFF);
+	else
+		put(b, x, 0, x+t, (int)cy + 1, 0xFF);
+	if (sx > 0)
+		put(b, (int)cx, y, b->cw, y+t, 0xFF);
+	else
+		put(b, 0, y, (int)cx + 1, y+t, 0xFF);
+}
+
+/** Draws a light diagonal from the top right to the bottom left if rising is
+ * set, or from the top left to the bottom right otherwise. */
+static void
+diagonal(struct box *b, int rising)
+{
+	int t = b->t1;
+
+	for (int y = 0; y < b->ch; ++y) {
+		double xc = (y + 0.5) * b->cw / b->ch;
+		if (rising)
+			xc = b->cw - xc;
+
+		int x = (int)(xc - t/2.0 + 0.5);
+		put(b, x, y, x+t, y+1, 0xFF);
+	}
+}
+
+int
+boxdraw_raster(rune c, uint8_t *mask, int cw, int ch)
+{
+	if (!boxdraw_has(c))
+		return 0;
+
+	memset(mask, 0, cw*ch);
+
+	struct box b = { .mask = mask, .cw = cw, .ch = ch };
+	b.t1 = cw/8 ? cw/8 : 1;
+	b.t2 = b.t1 == 1 ? 3 : 2*b.t1;
+	b.g = b.t1;
+	orient(&b, 0);
+
+	if (c >= 0x2580) {
+		// Block elements.
+		int n;
+		switch (c) {
+		case 0x2580: put(&b, 0, 0, cw, ch/2, 0xFF); break;
+		case 0x2590: put(&b, cw/2, 0, cw, ch, 0xFF); break;
+		case 0x2594: put(&b, 0, 0, cw, (ch+4)/8, 0xFF); break;
+		case 0x2595: put(&b, cw - (cw+4)/8, 0, cw, ch, 0xFF); break;
+
+		// Shades are solid grays, which the renderer turns into
+		// whatever gray levels the panel has, rather than patterns.
+		case 0x2591: put(&b, 0, 0, cw, ch, 0x40); break;
+		case 0x2592: put(&b, 0, 0, cw, ch, 0x80); break;
+		case 0x2593: put(&b, 0, 0, cw, ch, 0xC0); break;
+
+		default:
+			if (c <= 0x2588) {
+				// Lower eighths, up to the full block.
+				n = c - 0x2580;
+				put(&b, 0, ch - (ch*n + 4)/8, cw, ch, 0xFF);
+			} else if (c <= 0x258F) {
+				// Left eighths, from seven down to one.
+				n = 0x2590 - c;
+				put(&b, 0, 0, (cw*n + 4)/8, ch, 0xFF);
+			} else {
+				n = quadrants[c - 0x2596];
+				if (n & 1) put(&b, 0, 0, cw/2, ch/2, 0xFF);
+				if (n & 2) put(&b, cw/2, 0, cw, ch/2, 0xFF);
+				if (n & 4) put(&b, 0, ch/2, cw/2, ch, 0xFF);
+				if (n & 8) put(&b, cw/2, ch/2, cw, ch, 0xFF);
+			}
+			break;
+		}
+
+		return 1;
+	}
+
+	switch (c) {
+	case 0x2504: case 0x2505: // ┄ ┅
+	case 0x2508: case 0x2509: // ┈ ┉
+	case 0x254C: case 0x254D: // ╌ ╍
+		dashes(&b, c & 1 ? HEAVY : LIGHT, c >= 0x254C ? 2 : c >= 0x2508 ? 4 : 3);
+		return 1;
+	case 0x2506: case 0x2507: // ┆ ┇
+	case 0x250A: case 0x250B: // ┊ ┋
+	case 0x254E: case 0x254F: // ╎ ╏
+		orient(&b, 1);
+		dashes(&b, c & 1 ? HEAVY : LIGHT, c >= 0x254E ? 2 : c >= 0x250A ? 4 : 3);
+		return 1;
+	case 0x256D: arc(&b, 1, 1); return 1;   // ╭
+	case 0x256E: arc(&b, -1, 1); return 1;  // ╮
+	case 0x256F: arc(&b, -1, -1); return 1; // ╯
+	case 0x2570: arc(&b, 1, -1); return 1;  // ╰
+	case 0x2571: diagonal(&b, 1); return 1; // ╱
+	case 0x2572: diagonal(&b, 0); return 1; // ╲
+	case 0x2573: diagonal(&b, 1); diagonal(&b, 0); return 1; // ╳
+	}
+
+	const char *a = arms[c - 0x2500];
+	int u = a[0]-'0', r = a[1]-'0', d = a[2]-'0', l = a[3]-'0';
+
+	horizontal(&b, u, r, d, l);
+
+	// Up and down are left and right with the cell flipped over; what
+	// was above the middle is now to the left of it.
+	orient(&b, 1);
+	horizontal(&b, l, d, r, u);
+
+	return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef BOXDRAW_H
+#define BOXDRAW_H
+
+#include <stdint.h>
+
+#include "utf8.h"
+
+/* Box drawing (U+2500...U+257F) and block elements (U+2580...U+259F) are
+ * generated at whatever size the cell is, rather than taken from a font, so
+ * lines meet up with the ones in the next cell without gaps. */
+
+/** Returns non-zero if c is drawn by boxdraw_raster. */
+static inline int
+boxdraw_has(rune c)
+{
+	return c >= 0x2500 && c <= 0x259F;
+}
+
+/** Rasterizes rune c into a cw*ch mask.
+ * Pixels are how much of the foreground color they get, from 0 for none to
+ * 255 for all of it; only the shades use anything in between.
+ *
+ * Returns 0 if c is not a box drawing or block character.
+ */
+int boxdraw_raster(rune c, uint8_t *mask, int cw, int ch);
+
+#endif /* BOXDRAW_H */
@@ -3,74 +3,87 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+
 #include <libevdev/libevdev.h>
 
 #include "evdev.h"
 
-/* Opens the event device at evpath to determine if it is a keyboard or not.
- * If an error occurs, errno is set. */
+/* Number of longs it takes to hold a bit for each of n codes. */
+#define NLONGS(n) (((n) + 8*sizeof(long) - 1) / (8*sizeof(long)))
+
 static int
-is_keyboard(char *evpath)
+test_bit(const unsigned long *bits, int bit)
 {
-	struct libevdev *evdev = NULL;
-	int is_kbd = -1;
-	int rc;
-	int fd = open(evpath, O_RDONLY|O_NONBLOCK);
-	if (fd == -1)
-		return -1;
+	return (bits[bit / (8*sizeof(long))] >> (bit % (8*sizeof(long)))) & 1;
+}
 
-	// Try to init libevdev.
-	// In theory this can only fail if fd does not point to an event device.
-	if ((rc = libevdev_new_from_fd(fd, &evdev)) < 0) {
-		errno = -rc;
-		goto fail;
-	}
+/* Asks the device behind fd whether it is a keyboard.
+ * This goes straight to the kernel for the two bitmaps that matter, instead
+ * of having libevdev fetch everything there is to know about the device. */
+static int
+is_keyboard(int fd)
+{
+	unsigned long types[NLONGS(EV_MAX+1)] = {0};
+	unsigned long keys[NLONGS(KEY_MAX+1)] = {0};
+
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(types)), types) == -1)
+		return 0;
 
 	// Keyboards should have both EV_KEY and EV_REP.
-	is_kbd = libevdev_has_event_type(evdev, EV_KEY) &&
-		 libevdev_has_event_type(evdev, EV_REP);
-	if (!is_kbd)
-		goto fail;
+	if (!test_bit(types, EV_KEY) || !test_bit(types, EV_REP))
+		return 0;
+
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) == -1)
+		return 0;
 
 	// Additionally, keyboards should have keys.
 	// FBInk seems like it tests for codes 1-32, so let's do the same
 	// thing. (See input-event-codes.h in Linux headers.)
-	for (int i = 1; i <= 32; ++i) {
-		if ((is_kbd = !!libevdev_has_event_code(evdev, EV_KEY, i)) == 0)
-			goto fail;
-	}
+	for (int i = 1; i <= 32; ++i)
+		if (!test_bit(keys, i))
+			return 0;
 
-fail:
-	if (fd)
-		close(fd);
-	if (evdev)
-		libevdev_free(evdev);
-	return is_kbd;
+	return 1;
 }
 
-/* Finds the first keyboard input device. */
-static char *
-find_keyboard(void)
+/* Opens the event device at evpath to determine if it is a keyboard or not,
+ * unless the same device has been seen before.
+ * If an error occurs, errno is set. */
+static int
+probe(struct evdev_watch *w, char *evpath)
 {
-	static char buf[512] = {0}; // Far more than enough
-	DIR *dir;
-	struct dirent *dirent;
+	struct evdev_probe p = {0};
+	int fd = open(evpath, O_RDONLY|O_NONBLOCK);
+	if (fd == -1)
+		return -1;
 
-	dir = opendir("/dev/input");
-	if (dir == NULL)
-		return NULL;
+	// Nodes that aren't event devices fail here.
+	if (ioctl(fd, EVIOCGID, &p.id) == -1 || ioctl(fd, EVIOCGNAME(sizeof(p.name)-1), p.name) == -1) {
+		int old_errno = errno;
+		close(fd);
+		errno = old_errno;
+		return -1;
+	}
 
-	while ((dirent = readdir(dir)) != NULL) {
-		snprintf(buf, sizeof(buf), "/dev/input/%s", dirent->d_name);
-		if (is_keyboard(buf) == 1)
-			goto done;
+	int n = w->nprobes < EVDEV_PROBES_MAX ? w->nprobes : EVDEV_PROBES_MAX;
+	for (int i = 0; i < n; ++i) {
+		struct evdev_probe *q = &w->probes[i];
+		if (!memcmp(&q->id, &p.id, sizeof(p.id)) && !strcmp(q->name, p.name)) {
+			close(fd);
+			return q->is_kbd;
+		}
 	}
 
-done:
-	closedir(dir);
-	return buf;
+	// The oldest one makes room once there is no more.
+	p.is_kbd = is_keyboard(fd);
+	w->probes[w->nprobes++ % EVDEV_PROBES_MAX] = p;
+	close(fd);
+	return p.is_kbd;
 }
 
 int
@@ -78,11 +91,6 @@ evdev_init(struct evdev *evk, char *eventfile)
 {
 	assert(evk);
 
-	// If eventfile wasn't specified, look for the first keyboard.
-	if (eventfile == NULL)
-		eventfile = find_keyboard();
-
-	// Not specified and not found
 	if (eventfile == NULL) {
 		errno = EINVAL;
 		return -1;
@@ -146,24 +154,234 @@ evdev_free(struct evdev *evk)
 	libevdev_free(evk->ctx);
 }
 
+/* Calls the handlers for the frame that just ended. */
+static void
+dispatch(struct evdev *evk)
+{
+	int moved = 0;
+	for (int i = 0; i < evk->nframe; ++i) {
+		struct input_event *ev = &evk->frame[i];
+		if (ev->type == EV_ABS && (ev->code == ABS_X || ev->code == ABS_Y))
+			moved = 1;
+	}
+
+	// libevdev keeps track of where things are, so there is no need to
+	// go through the events for it.
+	if (moved && evk->on_move) {
+		evk->on_move(evk,
+			libevdev_get_event_value(evk->ctx, EV_ABS, ABS_X),
+			libevdev_get_event_value(evk->ctx, EV_ABS, ABS_Y));
+	}
+
+	for (int i = 0; i < evk->nframe; ++i)
+		if (evk->frame[i].type == EV_KEY && evk->on_key)
+			evk->on_key(evk, evk->frame[i]);
+
+	evk->nframe = 0;
+}
+
 int
 evdev_handle(struct evdev *evk)
 {
-	int rc;
+	int rc, flag = LIBEVDEV_READ_FLAG_NORMAL;
 	struct input_event ev;
 
 	assert(evk);
 
-	// Read events as they come in.
-	do {
-		rc = libevdev_next_event(evk->ctx, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-		if (rc == 0 && ev.type == EV_KEY)
-			evk->on_key(evk, ev);
-		else if (rc == 0 && ev.type == EV_ABS)
-			evk->on_mouse(evk, ev);
-	} while (rc == 1);
+	// libevdev reads everything there is from the device at once, and
+	// hands it out one event at a time.
+	for (;;) {
+		rc = libevdev_next_event(evk->ctx, flag, &ev);
 
-	if (rc < 0)
-		errno = -rc;
-	return rc < 0 ? -1 : 0;
+		if (rc == -EAGAIN) {
+			// Once the changes after a drop are all out, they
+			// make up a frame, and it is back to normal.
+			if (flag == LIBEVDEV_READ_FLAG_SYNC) {
+				dispatch(evk);
+				flag = LIBEVDEV_READ_FLAG_NORMAL;
+				continue;
+			}
+			return 0;
+		} else if (rc < 0) {
+			errno = -rc;
+			return -1;
+		}
+
+		// Events were dropped. What is left of this frame is
+		// incomplete, and libevdev will tell what changed instead.
+		if (rc == LIBEVDEV_READ_STATUS_SYNC && flag == LIBEVDEV_READ_FLAG_NORMAL) {
+			evk->nframe = 0;
+			flag = LIBEVDEV_READ_FLAG_SYNC;
+			continue;
+		}
+
+		if (ev.type == EV_SYN) {
+			if (ev.code == SYN_REPORT)
+				dispatch(evk);
+			continue;
+		}
+
+		if (evk->nframe < EVDEV_FRAME_MAX)
+			evk->frame[evk->nframe++] = ev;
+	}
+}
+
+/* Attaches the node in /dev/input if it is a keyboard that isn't attached
+ * yet. */
+static void
+attach(struct evdev_watch *w, const char *node)
+{
+	char path[512];
+	int slot = -1;
+
+	if (strncmp(node, "event", 5) != 0)
+		return;
+
+	for (int i = 0; i < EVDEV_KEYBOARDS_MAX; ++i) {
+		if (!w->kbd[i].ctx) {
+			if (slot == -1)
+				slot = i;
+		} else if (!strcmp(w->node[i], node)) {
+			return;
+		}
+	}
+	if (slot == -1)
+		return;
+
+	// udev may not have let us at it yet; it says so with IN_ATTRIB once
+	// it has.
+	snprintf(path, sizeof(path), "/dev/input/%s", node);
+	if (probe(w, path) != 1)
+		return;
+
+	w->kbd[slot] = (struct evdev){ .on_key = w->on_key };
+	if (evdev_init(&w->kbd[slot], path) == -1) {
+		w->kbd[slot].ctx = NULL;
+		return;
+	}
+	snprintf(w->node[slot], sizeof(w->node[slot]), "%s", node);
+}
+
+/* Attaches every keyboard that is there right now. */
+static int
+scan(struct evdev_watch *w)
+{
+	DIR *dir = opendir("/dev/input");
+	struct dirent *dirent;
+	if (dir == NULL)
+		return -1;
+
+	while ((dirent = readdir(dir)) != NULL)
+		attach(w, dirent->d_name);
+
+	closedir(dir);
+	return 0;
+}
+
+int
+evdev_watch_init(struct evdev_watch *w, char *eventfile, void (*on_key)(struct evdev *, struct input_event))
+{
+	assert(w);
+
+	*w = (struct evdev_watch){ .fd = -1, .on_key = on_key };
+
+	// Just the one that was asked for.
+	if (eventfile) {
+		w->kbd[0].on_key = on_key;
+		if (evdev_init(&w->kbd[0], eventfile) == -1) {
+			w->kbd[0].ctx = NULL;
+			return -1;
+		}
+		snprintf(w->node[0], sizeof(w->node[0]), "%s", eventfile);
+		return 0;
+	}
+
+	// Start watching before looking, so that nothing plugged in in
+	// between is missed.
+	w->fd = inotify_init1(IN_NONBLOCK);
+	if (w->fd == -1)
+		return -1;
+	if (inotify_add_watch(w->fd, "/dev/input", IN_CREATE|IN_ATTRIB|IN_DELETE) == -1 || scan(w) == -1) {
+		int old_errno = errno;
+		close(w->fd);
+		w->fd = -1;
+		errno = old_errno;
+		return -1;
+	}
+	return 0;
+}
+
+int
+evdev_watch_handle(struct evdev_watch *w)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	int detached = 0;
+
+	assert(w);
+
+	for (;;) {
+		ssize_t n = read(w->fd, u.buf, sizeof(u.buf));
+		if (n == -1) {
+			if (errno == EAGAIN)
+				return detached;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		const struct inotify_event *ev;
+		for (char *p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			// Too much happened at once to know what; look again.
+			// Keyboards that went away fail to read and are
+			// detached then.
+			if (ev->mask & IN_Q_OVERFLOW) {
+				scan(w);
+				continue;
+			}
+			if (!ev->len)
+				continue;
+
+			if (!(ev->mask & IN_DELETE)) {
+				attach(w, ev->name);
+				continue;
+			}
+			for (int i = 0; i < EVDEV_KEYBOARDS_MAX; ++i) {
+				if (w->kbd[i].ctx && !strcmp(w->node[i], ev->name)) {
+					evdev_watch_detach(w, &w->kbd[i]);
+					++detached;
+				}
+			}
+		}
+	}
+}
+
+void
+evdev_watch_detach(struct evdev_watch *w, struct evdev *evk)
+{
+	assert(w && evk >= w->kbd && evk < w->kbd + EVDEV_KEYBOARDS_MAX);
+
+	if (!evk->ctx)
+		return;
+
+	fprintf(stderr, "no longer using %s\n", w->node[evk - w->kbd]);
+	evdev_free(evk);
+	evk->ctx = NULL;
+	w->node[evk - w->kbd][0] = '\0';
+}
+
+void
+evdev_watch_free(struct evdev_watch *w)
+{
+	assert(w);
+
+	for (int i = 0; i < EVDEV_KEYBOARDS_MAX; ++i)
+		evdev_watch_detach(w, &w->kbd[i]);
+	if (w->fd != -1)
+		close(w->fd);
+	w->fd = -1;
 }
@@ -3,6 +3,22 @@
 
 #include <libevdev/libevdev.h>
 
+/* The most events a frame can have. Whatever comes after that in the same
+ * frame is dropped. */
+#define EVDEV_FRAME_MAX 64
+
+/* The most keyboards that can be attached at once. */
+#define EVDEV_KEYBOARDS_MAX 8
+
+/* How many devices the probe remembers being a keyboard or not. */
+#define EVDEV_PROBES_MAX 32
+
+/** An input device.
+ *
+ * Devices report everything that happened at the same time as a frame of
+ * events that ends with SYN_REPORT. Handlers are called once a frame is
+ * complete, so a touch that moves both axes is one move instead of two.
+ */
 struct evdev {
 	/** File descriptor that evdev is reading from.
 	 * Set to be non-blocking. */
@@ -11,14 +27,54 @@ struct evdev {
 	/** evdev context for fd */
 	struct libevdev *ctx;
 
-	/** on key handler */
+	/** on key handler, called for every key event of a frame in order,
+	 * after on_move. */
+	void (*on_key)(struct evdev *evk, struct input_event ev);
+
+	/** on move handler, called once for a frame that changed ABS_X or
+	 * ABS_Y, with where they ended up. May be NULL. */
+	void (*on_move)(struct evdev *evk, int x, int y);
+
+	/** Events of the frame that is coming in. */
+	struct input_event frame[EVDEV_FRAME_MAX];
+	int nframe;
+};
+
+/** Keyboards that come and go.
+ *
+ * /dev/input is watched with inotify, so a keyboard that is plugged in or
+ * connects over Bluetooth is attached right away, and one that goes away is
+ * detached again.
+ *
+ * Finding out whether a node is a keyboard takes a few ioctls on it. What
+ * comes out is remembered by the device's id and name, so a keyboard that
+ * reconnects, or a touchscreen that keeps changing its attributes, is only
+ * asked once.
+ */
+struct evdev_watch {
+	/** inotify descriptor for /dev/input, or -1 if there is only the one
+	 * keyboard that was asked for. Set to be non-blocking. */
+	int fd;
+
+	/** Attached keyboards. Slots with a NULL ctx are free. */
+	struct evdev kbd[EVDEV_KEYBOARDS_MAX];
+
+	/** Node in /dev/input each keyboard was opened from. */
+	char node[EVDEV_KEYBOARDS_MAX][32];
+
+	/** on key handler of every keyboard. */
 	void (*on_key)(struct evdev *evk, struct input_event ev);
 
-	/** on mouse handler */
-	void (*on_mouse)(struct evdev *evk, struct input_event ev);
+	/* Everything below is private. */
+	struct evdev_probe {
+		struct input_id id;
+		char name[64];
+		int is_kbd;
+	} probes[EVDEV_PROBES_MAX];
+	int nprobes;
 };
 
-/** Initializes evdev and xkbcommon to read keyboard events from eventfile.
+/** Initializes evdev to read events from eventfile.
  *
  * Returns -1 on error.
  */
@@ -27,7 +83,30 @@ int evdev_init(struct evdev *evk, char *eventfile);
 /** Frees evdev and xkbcommon stuff. */
 void evdev_free(struct evdev *evk);
 
-/** Handles evdev events as they come in and writes keys to the terminal pty.
+/** Attaches the keyboard at eventfile, or if it is NULL, every keyboard in
+ * /dev/input now and later. Keys go to on_key.
+ *
+ * Returns -1 on error; not finding any keyboard yet is not one.
+ */
+int evdev_watch_init(struct evdev_watch *w, char *eventfile, void (*on_key)(struct evdev *, struct input_event));
+
+/** Attaches and detaches keyboards for what inotify has to say, once w->fd is
+ * readable.
+ *
+ * Returns how many keyboards were detached, or -1 on error and sets errno. */
+int evdev_watch_handle(struct evdev_watch *w);
+
+/** Detaches evk, for example because reading from it failed. */
+void evdev_watch_detach(struct evdev_watch *w, struct evdev *evk);
+
+/** Detaches every keyboard and stops watching. */
+void evdev_watch_free(struct evdev_watch *w);
+
+/** Reads every event that is available, and calls the handlers for every
+ * frame that is complete.
+ * If the kernel ran out of room for events and dropped some, the frame that
+ * was cut short is thrown away, and whatever changed in the meantime is
+ * handled as a frame of its own.
  *
  * Returns -1 on error and sets errno. */
 int evdev_handle(struct evdev *evk);
@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "export.h"
+#include "x.h"
+
+/** Converts row y of term into the exported format. */
+static void
+copy_row(struct export *ex, struct term *term, int y)
+{
+	struct cell *src = &term->cells[y*term->cols];
+	struct export_cell *dst = &ex->cells[y*term->cols];
+
+	for (int x = 0; x < term->cols; ++x) {
+		dst[x].c = src[x].c;
+		dst[x].fg = src[x].fg;
+		dst[x].bg = src[x].bg;
+		dst[x].attr = (unsigned char)src[x].attr;
+	}
+
+	memcpy(&ex->last[y*term->cols], src, sizeof(*src)*term->cols);
+}
+
+/** Publishes rows of term, all of them if force is set. */
+static void
+publish(struct export *ex, struct term *term, int force)
+{
+	uint32_t seq = ex->hdr->seq + 1;
+
+	// Readers that see an odd sequence number know to come back later.
+	__atomic_store_n(&ex->hdr->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (int y = 0; y < term->rows; ++y) {
+		size_t off = y*term->cols;
+		if (!force && memcmp(&ex->last[off], &term->cells[off], sizeof(*term->cells)*term->cols) == 0)
+			continue;
+
+		copy_row(ex, term, y);
+		ex->gens[y] = seq + 1;
+	}
+
+	ex->hdr->row = term->row;
+	ex->hdr->col = term->col;
+
+	__atomic_store_n(&ex->hdr->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+export_init(struct export *ex, const char *name, struct term *term)
+{
+	int old_errno;
+
+	memset(ex, 0, sizeof(*ex));
+	snprintf(ex->name, sizeof(ex->name), "/%s", name);
+
+	size_t size = sizeof(*ex->hdr)
+		+ sizeof(*ex->gens)*term->rows
+		+ sizeof(*ex->cells)*term->rows*term->cols;
+
+	// The screen has whatever was typed on it, passwords included, so
+	// nobody else gets to read it. An object left over from before keeps
+	// its old mode, so that is set too.
+	int fd = shm_open(ex->name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1)
+		return -1;
+
+	if (fchmod(fd, 0600) == -1)
+		goto fail;
+
+	if (ftruncate(fd, size) == -1)
+		goto fail;
+
+	void *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	// The mapping stays valid after the fd is closed.
+	close(fd);
+	fd = -1;
+
+	ex->hdr = ptr;
+	ex->gens = (uint32_t *)(ex->hdr+1);
+	ex->cells = (struct export_cell *)(ex->gens+term->rows);
+
+	ex->last = malloc(sizeof(*ex->last)*term->rows*term->cols);
+	if (!ex->last) {
+		munmap(ptr, size);
+		goto fail;
+	}
+
+	ex->hdr->version = EXPORT_VERSION;
+	ex->hdr->rows = term->rows;
+	ex->hdr->cols = term->cols;
+	ex->hdr->size = size;
+	publish(ex, term, 1);
+
+	// The magic goes in last, so nobody reads a half set up object.
+	__atomic_store_n(&ex->hdr->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	old_errno = errno;
+
+	if (fd != -1)
+		close(fd);
+	shm_unlink(ex->name);
+	ex->hdr = NULL;
+
+	errno = old_errno;
+	return -1;
+}
+
+void
+export_update(struct export *ex, struct term *term)
+{
+	assert(ex->hdr);
+	assert(ex->hdr->rows == term->rows && ex->hdr->cols == term->cols);
+
+	publish(ex, term, 0);
+}
+
+void
+export_free(struct export *ex)
+{
+	if (!ex->hdr)
+		return;
+
+	munmap(ex->hdr, ex->hdr->size);
+	shm_unlink(ex->name);
+	free(ex->last);
+	ex->hdr = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "term.h"
+
+/* The screen of a terminal can be published in a POSIX shared memory object
+ * so other processes can read it without going through the framebuffer.
+ *
+ * The object starts with a struct export_header, followed by one uint32_t
+ * generation counter per row, followed by rows*cols struct export_cells in
+ * row-major order.
+ *
+ * The writer never waits for readers. Everything after magic is guarded by
+ * a sequence lock: seq is odd while an update is being written. To read:
+ *
+ * 1. Load seq with acquire semantics. If it is odd, try again.
+ * 2. Copy the cursor and any rows whose generation differs from the one you
+ *    copied last time.
+ * 3. Issue an acquire fence and load seq again. If it changed, the copy may
+ *    be torn; go back to 1.
+ *
+ * A row's generation is the value seq had after the update that last changed
+ * it, so it is never zero once the row has been published.
+ */
+
+#define EXPORT_MAGIC	0x6D746B69 /* "iktm" */
+#define EXPORT_VERSION	1
+
+struct export_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rows, cols;
+	uint32_t seq;
+
+	/** Cursor position. */
+	int32_t row, col;
+
+	/** Size of the whole object in bytes. */
+	uint32_t size;
+};
+
+struct export_cell {
+	uint32_t c;
+	uint32_t fg, bg; // See COLOR_GRAY
+	uint32_t attr;
+};
+
+struct export {
+	/** Name of the shared memory object. */
+	char name[64];
+
+	struct export_header *hdr;
+	uint32_t *gens;
+	struct export_cell *cells;
+
+	/** The cells as of the last update, to find changed rows. */
+	struct cell *last;
+};
+
+/** Creates the shared memory object name for term and publishes its screen.
+ * Any existing object with the same name is replaced.
+ *
+ * Returns -1 on error and sets errno.
+ */
+int export_init(struct export *ex, const char *name, struct term *term);
+
+/** Publishes every row of term that changed since the last update, along
+ * with the cursor. */
+void export_update(struct export *ex, struct term *term);
+
+/** Unmaps and removes the shared memory object. */
+void export_free(struct export *ex);
+
+#endif /* EXPORT_H */
@@ -0,0 +1,144 @@
+#include <string.h>
+
+#include "font.h"
+
+/* Glyphs are 5 pixels wide and 8 tall, with bit 4 being the leftmost column.
+ * The last row is only used by descenders. */
+#define GLYPH_W 5
+#define GLYPH_H 8
+
+/* Glyphs are placed in a box with a column of space to the right and a row of
+ * space above and below, which is then scaled to the size of the cell. */
+#define BOX_W (GLYPH_W+1)
+#define BOX_H (GLYPH_H+2)
+
+static const uint8_t glyphs[][GLYPH_H] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* ' ' */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04, 0x00 }, /* ! */
+	{ 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* " */
+	{ 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A, 0x00 }, /* # */
+	{ 0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04, 0x00 }, /* $ */
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03, 0x00 }, /* % */
+	{ 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D, 0x00 }, /* & */
+	{ 0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* ' */
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02, 0x00 }, /* ( */
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08, 0x00 }, /* ) */
+	{ 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00, 0x00 }, /* asterisk */
+	{ 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00, 0x00 }, /* + */
+	{ 0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08, 0x00 }, /* , */
+	{ 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00, 0x00 }, /* - */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 }, /* . */
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00, 0x00 }, /* slash */
+	{ 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E, 0x00 }, /* 0 */
+	{ 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x00 }, /* 1 */
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F, 0x00 }, /* 2 */
+	{ 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E, 0x00 }, /* 3 */
+	{ 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02, 0x00 }, /* 4 */
+	{ 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E, 0x00 }, /* 5 */
+	{ 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E, 0x00 }, /* 6 */
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08, 0x00 }, /* 7 */
+	{ 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E, 0x00 }, /* 8 */
+	{ 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C, 0x00 }, /* 9 */
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00, 0x00 }, /* : */
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08, 0x00 }, /* ; */
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02, 0x00 }, /* < */
+	{ 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00, 0x00 }, /* = */
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08, 0x00 }, /* > */
+	{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04, 0x00 }, /* ? */
+	{ 0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E, 0x00 }, /* @ */
+	{ 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x00 }, /* A */
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E, 0x00 }, /* B */
+	{ 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E, 0x00 }, /* C */
+	{ 0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C, 0x00 }, /* D */
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F, 0x00 }, /* E */
+	{ 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10, 0x00 }, /* F */
+	{ 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F, 0x00 }, /* G */
+	{ 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11, 0x00 }, /* H */
+	{ 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x00 }, /* I */
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C, 0x00 }, /* J */
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11, 0x00 }, /* K */
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F, 0x00 }, /* L */
+	{ 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11, 0x00 }, /* M */
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11, 0x00 }, /* N */
+	{ 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00 }, /* O */
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10, 0x00 }, /* P */
+	{ 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D, 0x00 }, /* Q */
+	{ 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11, 0x00 }, /* R */
+	{ 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E, 0x00 }, /* S */
+	{ 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00 }, /* T */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x00 }, /* U */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x00 }, /* V */
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A, 0x00 }, /* W */
+	{ 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11, 0x00 }, /* X */
+	{ 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x00 }, /* Y */
+	{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F, 0x00 }, /* Z */
+	{ 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E, 0x00 }, /* [ */
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00 }, /* backslash */
+	{ 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E, 0x00 }, /* ] */
+	{ 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* ^ */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F, 0x00 }, /* _ */
+	{ 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* ` */
+	{ 0x00, 0x00, 0x0E, 0x01, 0x0F, 0x11, 0x0F, 0x00 }, /* a */
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1E, 0x00 }, /* b */
+	{ 0x00, 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E, 0x00 }, /* c */
+	{ 0x01, 0x01, 0x0D, 0x13, 0x11, 0x11, 0x0F, 0x00 }, /* d */
+	{ 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x00 }, /* e */
+	{ 0x06, 0x09, 0x08, 0x1C, 0x08, 0x08, 0x08, 0x00 }, /* f */
+	{ 0x00, 0x00, 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x0E }, /* g */
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11, 0x00 }, /* h */
+	{ 0x04, 0x00, 0x0C, 0x04, 0x04, 0x04, 0x0E, 0x00 }, /* i */
+	{ 0x02, 0x00, 0x06, 0x02, 0x02, 0x02, 0x12, 0x0C }, /* j */
+	{ 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12, 0x00 }, /* k */
+	{ 0x0C, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x00 }, /* l */
+	{ 0x00, 0x00, 0x1A, 0x15, 0x15, 0x11, 0x11, 0x00 }, /* m */
+	{ 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11, 0x00 }, /* n */
+	{ 0x00, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E, 0x00 }, /* o */
+	{ 0x00, 0x00, 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10 }, /* p */
+	{ 0x00, 0x00, 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x01 }, /* q */
+	{ 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10, 0x00 }, /* r */
+	{ 0x00, 0x00, 0x0E, 0x10, 0x0E, 0x01, 0x1E, 0x00 }, /* s */
+	{ 0x08, 0x08, 0x1C, 0x08, 0x08, 0x09, 0x06, 0x00 }, /* t */
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0D, 0x00 }, /* u */
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x00 }, /* v */
+	{ 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0A, 0x00 }, /* w */
+	{ 0x00, 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x00 }, /* x */
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x0F, 0x01, 0x0E }, /* y */
+	{ 0x00, 0x00, 0x1F, 0x02, 0x04, 0x08, 0x1F, 0x00 }, /* z */
+	{ 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02, 0x00 }, /* { */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00 }, /* | */
+	{ 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08, 0x00 }, /* } */
+	{ 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00, 0x00 }, /* ~ */
+};
+
+/* Drawn for anything we don't have a glyph for. */
+static const uint8_t tofu[GLYPH_H] = {
+	0x1F, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1F, 0x00
+};
+
+void
+font_raster(rune c, uint8_t *mask, int cw, int ch)
+{
+	const uint8_t *glyph;
+
+	memset(mask, 0, cw*ch);
+
+	if (c == 0 || c == ' ')
+		return;
+	else if (c > ' ' && c <= '~')
+		glyph = glyphs[c-' '];
+	else
+		glyph = tofu;
+
+	// Nearest neighbor scaling from the box to the cell.
+	for (int y = 0; y < ch; ++y) {
+		int gy = y*BOX_H/ch - 1;
+		if (gy < 0 || gy >= GLYPH_H || !glyph[gy])
+			continue;
+
+		for (int x = 0; x < cw; ++x) {
+			int gx = x*BOX_W/cw;
+			if (gx < GLYPH_W && glyph[gy] & (1 << (GLYPH_W-1-gx)))
+				mask[y*cw+x] = 1;
+		}
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <stdint.h>
+
+#include "utf8.h"
+
+/* A tiny built-in bitmap font, for backends that have no font of their own.
+ * Only printable ASCII has glyphs; everything else is drawn as a box. */
+
+/** Rasterizes rune c into a cw*ch mask, scaled to fit the cell.
+ * Set pixels are 1, everything else is 0. */
+void font_raster(rune c, uint8_t *mask, int cw, int ch);
+
+#endif /* FONT_H */
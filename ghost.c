@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "ghost.h"
+#include "render.h"
+
+int
+ghost_init(struct ghost *g, int width, int height, int threshold, int idle)
+{
+	g->threshold = threshold < 1 ? 1 : threshold > 255 ? 255 : threshold;
+	g->idle = idle;
+	g->width = width;
+	g->height = height;
+	g->cols = (width + GHOST_TILE-1) / GHOST_TILE;
+	g->rows = (height + GHOST_TILE-1) / GHOST_TILE;
+	g->pending = 0;
+
+	g->count = calloc(g->cols*g->rows, 1);
+	return g->count ? 0 : -1;
+}
+
+void
+ghost_free(struct ghost *g)
+{
+	free(g->count);
+	g->count = NULL;
+}
+
+void
+ghost_note(struct ghost *g, int x, int y, int w, int h, int flags)
+{
+	if (w <= 0 || h <= 0) {
+		x = y = 0;
+		w = g->width;
+		h = g->height;
+	}
+
+	int col0 = x / GHOST_TILE, col1 = (x+w-1) / GHOST_TILE;
+	int row0 = y / GHOST_TILE, row1 = (y+h-1) / GHOST_TILE;
+	if (col1 > g->cols-1) col1 = g->cols-1;
+	if (row1 > g->rows-1) row1 = g->rows-1;
+
+	int clean = flags & (REFRESH_QUALITY|REFRESH_FLASH);
+	for (int row = row0; row <= row1; ++row) {
+		for (int col = col0; col <= col1; ++col) {
+			uint8_t *c = &g->count[row*g->cols + col];
+			int was = *c >= g->threshold;
+
+			// A quality refresh only cleans tiles it covers all of;
+			// the edges keep whatever they had. Tiles on the right
+			// and bottom may be cut off by the edge of the screen.
+			int x1 = (col+1)*GHOST_TILE, y1 = (row+1)*GHOST_TILE;
+			if (x1 > g->width) x1 = g->width;
+			if (y1 > g->height) y1 = g->height;
+
+			int covered = col*GHOST_TILE >= x && x1 <= x+w
+			           && row*GHOST_TILE >= y && y1 <= y+h;
+			if (clean && covered)
+				*c = 0;
+			else if (!clean && *c < 255)
+				++*c;
+
+			g->pending += (*c >= g->threshold) - was;
+		}
+	}
+}
+
+void
+ghost_collect(struct ghost *g, struct region_set *set)
+{
+	for (int row = 0; row < g->rows; ++row)
+		for (int col = 0; col < g->cols; ++col)
+			if (g->count[row*g->cols + col] >= g->threshold)
+				region_add(set, col*GHOST_TILE, row*GHOST_TILE, GHOST_TILE, GHOST_TILE);
+}
@@ -0,0 +1,58 @@
+#ifndef GHOST_H
+#define GHOST_H
+
+#include <stdint.h>
+
+#include "region.h"
+
+/* Size of the squares the screen is split into for counting, in pixels. */
+#define GHOST_TILE 64
+
+/** Keeps track of how much ghosting has built up on the screen.
+ *
+ * Every refresh that doesn't use the quality waveform leaves a little bit of
+ * the old image behind. This counts those refreshes for every GHOST_TILE
+ * square of the screen, so that the squares that need it can be cleaned up
+ * with a quality refresh once the terminal is idle, instead of flashing the
+ * whole screen every now and then.
+ */
+struct ghost {
+	/** Fast refreshes a tile takes before it needs cleaning. */
+	int threshold;
+
+	/** How long the terminal has to be idle before cleaning, in
+	 * milliseconds. ghost doesn't use this itself. */
+	int idle;
+
+	/* Everything below is private. */
+	int width, height;
+	int cols, rows;
+	uint8_t *count;
+	int pending;
+};
+
+/** Sets up a ghost tracker for a screen of width*height pixels.
+ *
+ * Returns -1 if memory could not be allocated.
+ */
+int ghost_init(struct ghost *g, int width, int height, int threshold, int idle);
+
+/** Frees the memory used by a ghost tracker. */
+void ghost_free(struct ghost *g);
+
+/** Takes note of a refresh of the given region with REFRESH_* flags, which
+ * covers the whole screen if w or h is 0. */
+void ghost_note(struct ghost *g, int x, int y, int w, int h, int flags);
+
+/** Returns the number of tiles that need cleaning. */
+static inline int
+ghost_pending(const struct ghost *g)
+{
+	return g->pending;
+}
+
+/** Adds the tiles that need cleaning to set. They stay pending until a
+ * quality refresh covering them is noted. */
+void ghost_collect(struct ghost *g, struct region_set *set);
+
+#endif /* GHOST_H */
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "glyph.h"
+
+/* The hash table has twice as many slots as there are glyphs, so probes stay
+ * short. */
+#define TABLE_SIZE (GLYPH_CACHE_SIZE*2)
+
+struct glyph_key {
+	rune c;
+	uint32_t fg, bg;
+
+	/** Index into pixels + 1, or 0 if the slot is empty. */
+	uint32_t glyph;
+};
+
+static inline uint32_t
+hash(rune c, uint32_t fg, uint32_t bg)
+{
+	uint32_t h = c * 2654435761u;
+	h ^= fg * 2246822519u;
+	h ^= bg * 3266489917u;
+	return h ^ (h >> 15);
+}
+
+int
+glyph_init(struct glyph_cache *gc, int cw, int ch, int bpp)
+{
+	gc->cw = cw;
+	gc->ch = ch;
+	gc->bpp = bpp;
+	gc->count = 0;
+	gc->flushes = 0;
+
+	gc->keys = calloc(TABLE_SIZE, sizeof(*gc->keys));
+	gc->pixels = malloc((size_t)GLYPH_CACHE_SIZE*cw*ch*bpp);
+	if (!gc->keys || !gc->pixels) {
+		glyph_free(gc);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+glyph_free(struct glyph_cache *gc)
+{
+	free(gc->keys);
+	free(gc->pixels);
+	gc->keys = NULL;
+	gc->pixels = NULL;
+}
+
+/** Returns the slot that c, fg and bg are in, or the empty slot they would
+ * go in. */
+static inline uint32_t
+lookup(const struct glyph_cache *gc, rune c, uint32_t fg, uint32_t bg)
+{
+	uint32_t i = hash(c, fg, bg) % TABLE_SIZE;
+
+	// Linear probing; there is always an empty slot to stop at.
+	for (; gc->keys[i].glyph; i = (i+1) % TABLE_SIZE) {
+		struct glyph_key *k = &gc->keys[i];
+		if (k->c == c && k->fg == fg && k->bg == bg)
+			break;
+	}
+
+	return i;
+}
+
+const uint8_t *
+glyph_find(const struct glyph_cache *gc, rune c, uint32_t fg, uint32_t bg)
+{
+	uint32_t glyph = gc->keys[lookup(gc, c, fg, bg)].glyph;
+	return glyph ? gc->pixels + (glyph-1)*(size_t)gc->cw*gc->ch*gc->bpp : NULL;
+}
+
+const uint8_t *
+glyph_get(struct glyph_cache *gc, rune c, uint32_t fg, uint32_t bg)
+{
+	size_t sz = (size_t)gc->cw*gc->ch*gc->bpp;
+	uint32_t i = lookup(gc, c, fg, bg);
+
+	if (gc->keys[i].glyph)
+		return gc->pixels + (gc->keys[i].glyph-1)*sz;
+
+	if (gc->count == GLYPH_CACHE_SIZE) {
+		// Full. Starting over is cheaper than tracking what is old,
+		// and a screen rarely has this many different glyphs.
+		memset(gc->keys, 0, TABLE_SIZE*sizeof(*gc->keys));
+		gc->count = 0;
+		++gc->flushes;
+		i = hash(c, fg, bg) % TABLE_SIZE;
+	}
+
+	uint8_t *out = gc->pixels + gc->count*sz;
+	if (gc->raster(gc->ctx, c, fg, bg, out) == -1)
+		return NULL;
+
+	gc->keys[i] = (struct glyph_key){ .c = c, .fg = fg, .bg = bg, .glyph = ++gc->count };
+	return out;
+}
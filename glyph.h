@@ -0,0 +1,66 @@
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utf8.h"
+
+/* The most glyphs a cache holds before it starts over. */
+#define GLYPH_CACHE_SIZE 2048
+
+/** A cache of cells that have already been rasterized, stored in the pixel
+ * format of whatever they are going to be copied into. */
+struct glyph_cache {
+	/** Size of a cell in pixels, and bytes per pixel. */
+	int cw, ch, bpp;
+
+	/** Rasterizes rune c in the given colors into cw*ch*bpp bytes at out.
+	 * Returns -1 if it can't. */
+	int (*raster)(void *ctx, rune c, uint32_t fg, uint32_t bg, uint8_t *out);
+	void *ctx;
+
+	/** How many times the cache has been emptied to make room. */
+	unsigned flushes;
+
+	/* Everything below is private. */
+	struct glyph_key *keys;
+	uint8_t *pixels;
+	int count;
+};
+
+/** Sets up a glyph cache. raster and ctx must be filled in beforehand.
+ *
+ * Returns -1 if memory could not be allocated.
+ */
+int glyph_init(struct glyph_cache *gc, int cw, int ch, int bpp);
+
+/** Frees the memory used by a glyph cache. */
+void glyph_free(struct glyph_cache *gc);
+
+/** Returns the pixels of rune c in the given colors, rasterizing it if it
+ * isn't cached yet.
+ * The pointer is only valid until the next call, because the cache may be
+ * flushed to make room.
+ *
+ * Returns NULL if the glyph could not be rasterized.
+ */
+const uint8_t *glyph_get(struct glyph_cache *gc, rune c, uint32_t fg, uint32_t bg);
+
+/** Like glyph_get, but returns NULL rather than rasterizing anything, and
+ * never changes the cache, so it can be called from several threads at once
+ * as long as nothing else is using the cache. */
+const uint8_t *glyph_find(const struct glyph_cache *gc, rune c, uint32_t fg, uint32_t bg);
+
+/** Copies a glyph into pixels at dst, which are stride bytes per row. */
+static inline void
+glyph_blit(struct glyph_cache *gc, const uint8_t *glyph, uint8_t *dst, size_t stride)
+{
+	size_t len = gc->cw*gc->bpp;
+
+	for (int y = 0; y < gc->ch; ++y)
+		memcpy(dst + y*stride, glyph + y*len, len);
+}
+
+#endif /* GLYPH_H */
@@ -0,0 +1,118 @@
+/* Prints the screen of a running inkterm session that was exported with -x.
+ * With -f, keeps printing rows as they change.
+ *
+ * This is also a reference reader for the protocol in export.h. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "export.h"
+#include "utf8.h"
+#include "x.h"
+
+static void
+print_row(struct export_cell *row, int cols)
+{
+	for (int x = 0; x < cols; ++x) {
+		if (row[x].attr == ATTR_WIDEDUMMY)
+			continue;
+		fputs(row[x].c ? (char *)utf8_encode(row[x].c, NULL) : " ", stdout);
+	}
+	putchar('\n');
+}
+
+int
+main(int argc, char *argv[])
+{
+	int follow = 0, opt;
+	while ((opt = getopt(argc, argv, "f")) != -1) {
+		switch (opt) {
+		case 'f': follow = 1; break;
+		default: die("usage: %s [-f] name.N\n", argv[0]);
+		}
+	}
+	if (optind != argc-1)
+		die("usage: %s [-f] name.N\n", argv[0]);
+
+	char name[64];
+	snprintf(name, sizeof(name), "/%s", argv[optind]);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		die("shm_open %s: %s\n", name, strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct export_header))
+		die("%s is not an inkterm export\n", name);
+
+	struct export_header *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		die("mmap: %s\n", strerror(errno));
+	close(fd);
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != EXPORT_MAGIC || hdr->version != EXPORT_VERSION)
+		die("%s is not an inkterm export\n", name);
+
+	// Everything the header says is there has to really be there.
+	uint64_t row_size = sizeof(uint32_t) + (uint64_t)hdr->cols*sizeof(struct export_cell);
+	if (!hdr->rows || !hdr->cols || (st.st_size - sizeof(*hdr)) / row_size < hdr->rows)
+		die("%s is not an inkterm export\n", name);
+
+	int rows = hdr->rows, cols = hdr->cols;
+	uint32_t *gens = (uint32_t *)(hdr+1);
+	struct export_cell *cells = (struct export_cell *)(gens+rows);
+
+	// Our copy of the screen, and the generation of each row in it.
+	// Generations are always even, so starting off odd gets every row
+	// copied the first time around.
+	uint32_t *seen = xmalloc(sizeof(*seen)*rows);
+	for (int y = 0; y < rows; ++y)
+		seen[y] = 1;
+	uint32_t *copied = xmalloc(sizeof(*copied)*rows);
+	struct export_cell *screen = xmalloc(sizeof(*screen)*rows*cols);
+
+	for (;;) {
+		uint32_t seq;
+		int changed;
+
+		do {
+			seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+
+			changed = 0;
+			for (int y = 0; y < rows; ++y) {
+				copied[y] = gens[y];
+				if (copied[y] == seen[y])
+					continue;
+				memcpy(&screen[y*cols], &cells[y*cols], sizeof(*screen)*cols);
+				changed = 1;
+			}
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) || __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+
+		for (int y = 0; y < rows; ++y) {
+			if (copied[y] == seen[y])
+				continue;
+			if (follow)
+				printf("%d: ", y+1);
+			print_row(&screen[y*cols], cols);
+			seen[y] = copied[y];
+		}
+
+		if (!follow)
+			break;
+		if (changed)
+			fflush(stdout);
+
+		nanosleep(&(struct timespec){ .tv_nsec = 50000000 }, NULL);
+	}
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "keymap.h"
+
+/* Set by the Makefile from the xkbcommon that is linked in. */
+#ifndef XKB_VERSION
+#define XKB_VERSION "unknown"
+#endif
+
+/* Parts of the XKB database a keymap is put together from. */
+static const char *const parts[] = {
+	"rules", "keycodes", "types", "compat", "symbols",
+};
+
+void
+keymap_names(struct xkb_rule_names *names, char *spec)
+{
+	const char **fields[] = {
+		&names->rules, &names->model, &names->layout, &names->variant,
+	};
+
+	*names = (struct xkb_rule_names){0};
+	for (int i = 0; i < sizeof(fields)/sizeof(*fields) && spec; ++i) {
+		char *end = strchr(spec, ':');
+		if (end)
+			*end++ = '\0';
+		*fields[i] = *spec ? spec : NULL;
+		spec = end;
+	}
+	if (spec && *spec)
+		names->options = spec;
+}
+
+const char *
+keymap_cache_path(void)
+{
+	static char buf[512];
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+	if (dir && *dir)
+		snprintf(buf, sizeof(buf), "%s", dir);
+	else if (home && *home)
+		snprintf(buf, sizeof(buf), "%s/.cache", home);
+	else
+		return NULL;
+
+	if (mkdir(buf, 0755) == -1 && errno != EEXIST)
+		return NULL;
+
+	size_t n = strlen(buf);
+	if (snprintf(buf+n, sizeof(buf)-n, "/inkterm.xkb") >= sizeof(buf)-n)
+		return NULL;
+	return buf;
+}
+
+/* Writes what a cache made for names starts with to buf.
+ * xkb falls back on the environment for names that aren't given, so those
+ * count too. */
+static int
+header(char *buf, size_t size, const struct xkb_rule_names *names)
+{
+	const char *fields[][2] = {
+		{ names->rules, "XKB_DEFAULT_RULES" },
+		{ names->model, "XKB_DEFAULT_MODEL" },
+		{ names->layout, "XKB_DEFAULT_LAYOUT" },
+		{ names->variant, "XKB_DEFAULT_VARIANT" },
+		{ names->options, "XKB_DEFAULT_OPTIONS" },
+	};
+
+	int n = snprintf(buf, size, "// inkterm xkbcommon " XKB_VERSION "\n//");
+	for (int i = 0; i < sizeof(fields)/sizeof(*fields) && n < size; ++i) {
+		const char *s = fields[i][0] && *fields[i][0] ? fields[i][0] : getenv(fields[i][1]);
+		n += snprintf(buf+n, size-n, "%s%s", i ? ":" : " ", s ? s : "");
+	}
+	if (n < size)
+		n += snprintf(buf+n, size-n, "\n");
+	return n < size ? n : -1;
+}
+
+/* Returns whether anything in the database changed after mtime.
+ * Packages replace files rather than write over them, which changes the
+ * directory they are in. */
+static int
+changed_since(struct xkb_context *ctx, time_t mtime)
+{
+	char path[512];
+	struct stat st;
+
+	for (unsigned i = 0; i < xkb_context_num_include_paths(ctx); ++i) {
+		for (int j = 0; j < sizeof(parts)/sizeof(*parts); ++j) {
+			snprintf(path, sizeof(path), "%s/%s", xkb_context_include_path_get(ctx, i), parts[j]);
+			if (stat(path, &st) == 0 && st.st_mtime > mtime)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Loads the keymap at path if it starts with head and is up to date. */
+static struct xkb_keymap *
+load(struct xkb_context *ctx, const char *path, const char *head, size_t headlen)
+{
+	struct xkb_keymap *keymap = NULL;
+	struct stat st;
+	char *buf = NULL;
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	if (fstat(fileno(f), &st) == -1 || st.st_size <= headlen)
+		goto done;
+	if (changed_since(ctx, st.st_mtime))
+		goto done;
+
+	if (!(buf = malloc(st.st_size+1)))
+		goto done;
+	if (fread(buf, 1, st.st_size, f) != st.st_size)
+		goto done;
+	buf[st.st_size] = '\0';
+
+	if (memcmp(buf, head, headlen) == 0)
+		keymap = xkb_keymap_new_from_string(ctx, buf+headlen, XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+
+done:
+	free(buf);
+	fclose(f);
+	return keymap;
+}
+
+/* Saves keymap to path, by way of a temporary file so that nothing ever
+ * loads half of it. */
+static void
+save(struct xkb_keymap *keymap, const char *path, const char *head)
+{
+	char tmp[512];
+	char *s = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (!s)
+		return;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		goto done;
+
+	FILE *f = fopen(tmp, "w");
+	if (!f)
+		goto done;
+	int ok = fputs(head, f) != EOF && fputs(s, f) != EOF;
+	if (fclose(f) == EOF || !ok || rename(tmp, path) == -1)
+		remove(tmp);
+
+done:
+	free(s);
+}
+
+struct xkb_keymap *
+keymap_load(struct xkb_context *ctx, const struct xkb_rule_names *names, const char *cache)
+{
+	char head[1024];
+	int headlen = cache ? header(head, sizeof(head), names) : -1;
+	struct xkb_keymap *keymap;
+
+	if (headlen != -1 && (keymap = load(ctx, cache, head, headlen)))
+		return keymap;
+
+	// Missing, stale or broken; do it the slow way.
+	keymap = xkb_keymap_new_from_names(ctx, names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (keymap && headlen != -1)
+		save(keymap, cache, head);
+	return keymap;
+}
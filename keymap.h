@@ -0,0 +1,28 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <xkbcommon/xkbcommon.h>
+
+/** Fills in names from spec, which is rules:model:layout:variant:options.
+ * Fields that are left out or empty are NULL, so xkb uses its defaults.
+ * Options are the rest of spec, since they contain colons themselves.
+ * spec is cut up in place, and names points into it. */
+void keymap_names(struct xkb_rule_names *names, char *spec);
+
+/** Returns where keymaps are cached, or NULL if there is nowhere to put them.
+ * The directory is created if it doesn't exist yet. */
+const char *keymap_cache_path(void);
+
+/** Returns the keymap for names.
+ *
+ * Compiling a keymap from the rules means reading and parsing a good part of
+ * the XKB database, which takes a while on a slow CPU. The result is saved
+ * to the file at cache, and later loaded from there as long as it was made by
+ * the same version of xkbcommon for the same names, and nothing in the
+ * database has changed since. cache may be NULL to always compile.
+ *
+ * Returns NULL on error.
+ */
+struct xkb_keymap *keymap_load(struct xkb_context *ctx, const struct xkb_rule_names *names, const char *cache);
+
+#endif /* KEYMAP_H */
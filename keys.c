@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <linux/input.h>
+
+#include "keys.h"
+
+/* How a special key is encoded.
+ * m below is 1 plus 1 for Shift, 2 for Alt and 4 for Control, and the whole
+ * parameter is left out when it is 1. */
+enum form {
+	CURSOR,	// CSI c, or SS3 c in application cursor mode; CSI 1;m c
+	SS3,	// SS3 c; CSI 1;m c
+	TILDE,	// CSI n ~; CSI n;m ~
+};
+
+/* Keys that send escape sequences, going by what xterm uses. */
+static const struct {
+	int key;
+	enum form form;
+	char c;
+	int n;
+} special[] = {
+	{ KEY_UP,	CURSOR, 'A' },
+	{ KEY_DOWN,	CURSOR, 'B' },
+	{ KEY_RIGHT,	CURSOR, 'C' },
+	{ KEY_LEFT,	CURSOR, 'D' },
+	{ KEY_HOME,	CURSOR, 'H' },
+	{ KEY_END,	CURSOR, 'F' },
+
+	{ KEY_INSERT,	TILDE, '~', 2 },
+	{ KEY_DELETE,	TILDE, '~', 3 },
+	{ KEY_PAGEUP,	TILDE, '~', 5 },
+	{ KEY_PAGEDOWN,	TILDE, '~', 6 },
+
+	{ KEY_F1,	SS3, 'P' },
+	{ KEY_F2,	SS3, 'Q' },
+	{ KEY_F3,	SS3, 'R' },
+	{ KEY_F4,	SS3, 'S' },
+	{ KEY_F5,	TILDE, '~', 15 },
+	{ KEY_F6,	TILDE, '~', 17 },
+	{ KEY_F7,	TILDE, '~', 18 },
+	{ KEY_F8,	TILDE, '~', 19 },
+	{ KEY_F9,	TILDE, '~', 20 },
+	{ KEY_F10,	TILDE, '~', 21 },
+	{ KEY_F11,	TILDE, '~', 23 },
+	{ KEY_F12,	TILDE, '~', 24 },
+};
+
+static void
+set(struct key *k, const char *fmt, int a, int b, int c)
+{
+	int n = snprintf(k->data, sizeof(k->data), fmt, a, b, c);
+	k->len = n < sizeof(k->data) ? n : 0;
+	k->c = 0;
+}
+
+/** Fills in what a special key sends, in normal and application cursor mode. */
+static void
+encode(struct key map[2][KEYS_MAX], int key, enum form form, char c, int n, int mods)
+{
+	struct key *k = &map[0][key], *app = &map[1][key];
+
+	switch (form) {
+	case CURSOR:
+		if (mods > 1) {
+			set(k, "\033[1;%d%c", mods, c, 0);
+			*app = *k;
+		} else {
+			set(k, "\033[%c", c, 0, 0);
+			set(app, "\033O%c", c, 0, 0);
+		}
+		break;
+	case SS3:
+		if (mods > 1)
+			set(k, "\033[1;%d%c", mods, c, 0);
+		else
+			set(k, "\033O%c", c, 0, 0);
+		*app = *k;
+		break;
+	case TILDE:
+		if (mods > 1)
+			set(k, "\033[%d;%d%c", n, mods, c);
+		else
+			set(k, "\033[%d%c", n, c, 0);
+		*app = *k;
+		break;
+	}
+}
+
+void
+keys_build(struct keys *keys, struct xkb_state *state)
+{
+	int shift = xkb_state_mod_name_is_active(state, XKB_MOD_NAME_SHIFT, XKB_STATE_MODS_EFFECTIVE) > 0;
+	int ctrl = xkb_state_mod_name_is_active(state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_EFFECTIVE) > 0;
+	keys->alt = xkb_state_mod_name_is_active(state, XKB_MOD_NAME_ALT, XKB_STATE_MODS_EFFECTIVE) > 0;
+	int mods = 1 + shift + 2*keys->alt + 4*ctrl;
+
+	for (int code = 0; code < KEYS_MAX; ++code) {
+		struct key *k = &keys->map[0][code];
+		memset(k, 0, sizeof(*k));
+
+		// Alt puts an escape in front, like xterm's metaSendsEscape.
+		// evdev keycodes have a fixed offset of 8.
+		char *text = keys->alt ? k->data+1 : k->data;
+		int n = xkb_state_key_get_utf8(state, code+8, text, KEY_BYTES-1);
+		if (n > 0 && n < KEY_BYTES-1) {
+			k->len = n;
+			if (keys->alt) {
+				k->data[0] = '\033';
+				++k->len;
+			} else if (utf8_decode((unsigned char *)text, n, &k->c) != n) {
+				k->c = 0;
+			}
+		} else {
+			memset(k, 0, sizeof(*k));
+		}
+
+		keys->map[1][code] = *k;
+	}
+
+	for (int i = 0; i < sizeof(special)/sizeof(*special); ++i)
+		encode(keys->map, special[i].key, special[i].form, special[i].c, special[i].n, mods);
+}
@@ -0,0 +1,54 @@
+#ifndef KEYS_H
+#define KEYS_H
+
+#include <stdint.h>
+
+#include <xkbcommon/xkbcommon.h>
+
+#include "utf8.h"
+
+/* Keys with evdev codes below this are looked up; the rest send nothing.
+ * Everything on a keyboard is in there. */
+#define KEYS_MAX 256
+
+/* Longest thing a key can send, which is a modified function key. */
+#define KEY_BYTES 8
+
+/** What a key sends to the pty. */
+struct key {
+	uint8_t len;
+	char data[KEY_BYTES];
+
+	/** The character it types, if it types exactly one, or 0. */
+	rune c;
+};
+
+/** What every key sends with the modifiers and layout that are active.
+ *
+ * Working this out takes a few calls into xkb per key, so it is done for all
+ * of them at once, and only again when the modifiers or the layout change.
+ * Pressing a key is then a lookup.
+ */
+struct keys {
+	/** Indexed by evdev code, in normal and application cursor mode. */
+	struct key map[2][KEYS_MAX];
+
+	/** Whether Alt is held. */
+	int alt;
+};
+
+/** Fills in keys for the current state of xkb. */
+void keys_build(struct keys *keys, struct xkb_state *state);
+
+/** Returns what the key with evdev code sends. appcursor is non-zero if the
+ * terminal has asked for application cursor keys (DECCKM). */
+static inline const struct key *
+keys_get(const struct keys *keys, int code, int appcursor)
+{
+	static const struct key none;
+	if (code < 0 || code >= KEYS_MAX)
+		return &none;
+	return &keys->map[!!appcursor][code];
+}
+
+#endif /* KEYS_H */
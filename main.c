@@ -4,7 +4,9 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <poll.h>
 #include <pwd.h>
 #include <signal.h>
@@ -18,6 +20,12 @@
 #include <xkbcommon/xkbcommon.h>
 
 #include "evdev.h"
+#include "export.h"
+#include "keymap.h"
+#include "keys.h"
+#include "pacer.h"
+#include "predict.h"
+#include "render_fbink.h"
 #include "term.h"
 #include "x.h"
 
@@ -26,11 +34,19 @@ static FBInkConfig fbc = {
 	.fontname = SCIENTIFICA,
 };
 
-static int child_pid;
+/** Decides how long to wait for the pty to go quiet before drawing.
+ * Turning its max up will increase throughput at the cost of screen update
+ * latency. */
+static struct pacer pacer;
 
-/** Turning this knob up or down will increase throughput at the cost of screen
- * update latency. */
-static int draw_timeout = 10;
+/** Output that never stops would never let the pacer's wait run out, so the
+ * screen is drawn anyway once something has been waiting this many
+ * milliseconds to be drawn. */
+static int frame_deadline = 150;
+
+/** Drawing is held off while this many refreshes are still on their way to
+ * the panel, so it doesn't get buried in work it can't keep up with. */
+static int max_inflight = 4;
 
 /* Internal variable that refreshes the screen on the next call to draw.
  * Most of the time, this is immediately after it is set. */
@@ -38,76 +54,107 @@ static int refresh_next = 0;
 
 static int max_rows, max_cols;
 
+static struct renderer *renderer;
+
+static struct sched sched;
+
+static struct ghost ghost;
+
+/* Typed characters shown before they are echoed, if turned on with -l. */
+static struct predict predict;
+
+/* When the user last typed something or the active session printed
+ * something, in milliseconds. Ghosting is only cleaned up after a while
+ * without either. */
+static int64_t last_active;
+
 static int mouse_cell_x, mouse_cell_y;
 static int mouse_min_x, mouse_min_y;
 static int mouse_max_x, mouse_max_y;
 
-/* Some keys require special handling. */
-static struct {
-	int key;
-	struct {
-		int sz;
-		const char *data;
-	} val;
-} string_binds[] = {
-	// Purely to avoid calling strlen at runtime, the val struct is used to
-	// give a size to a string. The KEYSTR macro fills val for us.
-	// sizeof(str) includes NUL; we don't when we write to the pty
-#define KEYSTR(str) { .sz = (sizeof((str))-1), .data = (str) }
-	// Kernel keycodes, not XKB! Though, this may change sooner or later.
-	{ KEY_UP,		KEYSTR("\033[A") },
-	{ KEY_DOWN,		KEYSTR("\033[B") },
-	{ KEY_RIGHT,		KEYSTR("\033[C") },
-	{ KEY_LEFT,		KEYSTR("\033[D") },
-
-	// Going by what xterm uses...
-	{ KEY_F1,		KEYSTR("\033[OP") },
-	{ KEY_F2,		KEYSTR("\033[OQ") },
-	{ KEY_F3,		KEYSTR("\033[OR") },
-	{ KEY_F4,		KEYSTR("\033[OS") },
-	{ KEY_F5,		KEYSTR("\033[15~") },
-	{ KEY_F6,		KEYSTR("\033[17~") },
-	{ KEY_F7,		KEYSTR("\033[18~") },
-	{ KEY_F8,		KEYSTR("\033[19~") },
-	{ KEY_F9,		KEYSTR("\033[20~") },
-	{ KEY_F10,		KEYSTR("\033[21~") },
-	{ KEY_F11,		KEYSTR("\033[23~") },
-	{ KEY_F12,		KEYSTR("\033[24~") },
-#undef KEYSTR
+/* What every key sends, rebuilt when the modifiers change. */
+static struct keys keys;
+
+/* The most shells that can run at once, one per Alt+Fn key. */
+#define MAX_SESSIONS 12
+
+/* A shell and the terminal it is running in.
+ * Only the active session is ever drawn; the others keep parsing their output
+ * in the background and are redrawn in full when switched to. */
+struct session {
+	struct term term;
+
+	/* Zero if the session is not running. */
+	pid_t pid;
+
+	/* Data read from the pty that term_write did not take, which is
+	 * probably an incomplete UTF-8 sequence. */
+	unsigned char buf[512];
+	int len;
+
+	/* Set when the screen changed since it was last exported. */
+	int dirty;
+
+	struct export export;
 };
 
-struct term term = {0};
+static struct session sessions[MAX_SESSIONS];
+static struct session *active;
+
+/* The terminal of the active session. */
+static struct term *term;
+
+static char **shell_args;
+
+/* If set, the screen of every session is published in shared memory under
+ * this name followed by the session number. See export.h. */
+static char *export_name = NULL;
+
+/* Set by the SIGCHLD handler; the main loop reaps children. */
+static volatile sig_atomic_t child_exited = 0;
+
+/* Set when the screen needs to be drawn once things settle down. */
+static int writing = 0;
+
+/* When writing was set, in milliseconds. */
+static int64_t undrawn_since;
+
+static int cell_w, cell_h;
+
+static void switch_session(int n);
+
+/* Alt plus one of these keys switches to the corresponding session. */
+static const int session_keys[MAX_SESSIONS] = {
+	KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6,
+	KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12,
+};
 
 static struct xkb_context *xkb_ctx = NULL;
 static struct xkb_keymap *xkb_keymap = NULL;
 static struct xkb_state *xkb_state = NULL;
 
-static void
-sigchld_handler(int _)
+static int64_t
+now_ms(void)
 {
-	int reason;
-	pid_t p;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
 
-	// Attempt to wait for our child.
-	// WNOHANG is used here to, as you may have guessed, not hang us.
-	if ((p = waitpid(child_pid, &reason, WNOHANG)) == -1)
-		die("failed to wait for child %d: %s\n", child_pid, strerror(errno));
-	else if (p == 0)
-		// Nothing to do
-		return;
+/* Notes that there is something new to draw. */
+static void
+damaged(void)
+{
+	if (!writing)
+		undrawn_since = now_ms();
+	writing = 1;
+}
 
-	/*
-	// Something happened, and there's a chance it could be fatal.
-	if (WIFSIGNALED(reason))
-		// TODO: I would like to have human readable signal names here.
-		// Everyone knows 9, but there are more.
-		die("child received signal %d\n", WTERMSIG(reason));
-	else if (WEXITSTATUS(reason) != 0)
-		die("child exited with status code %d\n", WEXITSTATUS(reason));
-
-	// Child exited peacefully.
-	*/
-	exit(0);
+static void
+sigchld_handler(int _)
+{
+	// Children are reaped by the main loop, see reap_sessions.
+	child_exited = 1;
 }
 
 /* Sets up the child for the psudeoterminal. */
@@ -167,46 +214,14 @@ handle_pty_child(int pty, char *path, char *argv[])
 	exit(EXIT_FAILURE); /* unreachable, most of the time */
 }
 
-static inline void
-draw_cell(int fb, int y, int x)
-{
-	if (y > term.rows-1 || x > term.cols-1) return;
-	fbc.row = y;
-	fbc.col = x;
-
-	struct cell cell = term.cells[(y*term.cols)+x];
-
-	fbc.is_inverted = !!(cell.attr & ATTR_REVERSE);
-	fbc.is_inverted ^= (x == term.col && y == term.row);
-
-	fbink_set_fg_pen_rgba(
-		(cell.fg & 0x00FF0000     >> 16)& 0xFF,
-		(cell.fg & 0x0000FF00     >> 8) & 0xFF,
-		(cell.fg & 0x000000FF)		& 0xFF,
-		0xFF,
-		0, 1
-	);
-
-	fbink_set_bg_pen_rgba(
-		(cell.bg & 0x00FF0000     >> 16)& 0xFF,
-		(cell.bg & 0x0000FF00     >> 8) & 0xFF,
-		(cell.bg & 0x000000FF)		& 0xFF,
-		0xFF,
-		0, 1
-	);
-
-	if (cell.c && cell.attr != ATTR_WIDEDUMMY) {
-		unsigned char *c = utf8_encode(cell.c, NULL);
-		fbink_print(fb, (char *)c, &fbc);
-	} else fbink_print(fb, " ", &fbc);
-	// fbink_grid_refresh(fb, 1, 1, &fbc);
-}
-
 static void
-bellhandler(void)
+bellhandler(struct term *t)
 {
 	// Set a flag for draw.
-	refresh_next = 1;
+	// Bells from sessions in the background can't be seen, so they are
+	// ignored.
+	if (t == term)
+		refresh_next = 1;
 }
 
 static void
@@ -232,16 +247,15 @@ free_xkb(void)
 }
 
 static int
-setup_xkb(void)
+setup_xkb(const struct xkb_rule_names *names)
 {
 	// Get a context object.
 	xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	if (!xkb_ctx)
 		goto fail;
 
-	// Load a keymap.
-	// TODO: Allow names to be configured.
-	xkb_keymap = xkb_keymap_new_from_names(xkb_ctx, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	// Load a keymap, from the cache if it is there.
+	xkb_keymap = keymap_load(xkb_ctx, names, keymap_cache_path());
 	if (!xkb_keymap)
 		goto fail;
 
@@ -249,6 +263,7 @@ setup_xkb(void)
 	xkb_state = xkb_state_new(xkb_keymap);
 	if (!xkb_state)
 		goto fail;
+	keys_build(&keys, xkb_state);
 
 	// Initialization successful.
 	return 0;
@@ -258,6 +273,20 @@ fail:
 	return -1;
 }
 
+/* Forgets which keys are held, for when a keyboard goes away while some
+ * are. */
+static void
+release_keys(void)
+{
+	struct xkb_state *state = xkb_state_new(xkb_keymap);
+	if (!state)
+		return;
+
+	xkb_state_unref(xkb_state);
+	xkb_state = state;
+	keys_build(&keys, xkb_state);
+}
+
 static void
 handle_key(struct evdev *_, struct input_event ev)
 {
@@ -277,52 +306,55 @@ handle_key(struct evdev *_, struct input_event ev)
 	if (ev.value == 2 && !xkb_keymap_key_repeats(xkb_keymap, code))
 		return;
 
-	// Check to see if the key was released (0).
-	if (ev.value == 0) {
-		// Tell xkb about it and return.
-		xkb_state_update_key(xkb_state, code, XKB_KEY_UP);
+	// Tell xkb about presses and releases. What keys send only changes
+	// along with the modifiers or the layout.
+	if (ev.value != 2) {
+		enum xkb_state_component changed = xkb_state_update_key(xkb_state, code, ev.value ? XKB_KEY_DOWN : XKB_KEY_UP);
+		if (changed & (XKB_STATE_MODS_EFFECTIVE|XKB_STATE_LAYOUT_EFFECTIVE))
+			keys_build(&keys, xkb_state);
+	}
+
+	// Nothing more to do for a release.
+	if (ev.value == 0)
 		return;
-	} else if (ev.value == 1)
-		// Key was just pressed and is NOT a repeat.
-		xkb_state_update_key(xkb_state, code, XKB_KEY_DOWN);
-
-	// Check to see if this is a key that requires special handling.
-	for (int i = 0; i < ARRAYLEN(string_binds); ++i) {
-		// Note that this is ev.code and not code.
-		if (string_binds[i].key == ev.code) {
-			// Yes it is. Write the string to the pty and return.
-			// TODO: Handle partial writes in the unlikely event it
-			// happens.
-			write(term.pty, string_binds[i].val.data, string_binds[i].val.sz);
-			return;
+
+	// Alt+Fn switches sessions.
+	if (ev.value == 1 && keys.alt) {
+		for (int i = 0; i < MAX_SESSIONS; ++i) {
+			if (session_keys[i] == ev.code) {
+				switch_session(i);
+				return;
+			}
 		}
 	}
 
-	// Write the key to the pty.
-	char outbuf[5] = {0}; // 4 bytes + 1 for NUL
-	int n = xkb_state_key_get_utf8(xkb_state, code, outbuf, sizeof(outbuf));
-	if (n == 0)
+	const struct key *k = keys_get(&keys, ev.code, term->state & STATE_APPCURSOR);
+	if (!k->len)
 		return; // Nothing more to do.
 
-	// TODO: Handle partial writes in the unlikely event it happens.
-	write(term.pty, outbuf, n);
+	// A key that didn't go out shouldn't be predicted either.
+	if (!term_send(term, k->data, k->len))
+		return;
+
+	// A single character may be shown right away, instead of waiting for
+	// the echo. It is drawn like any other change, so a busy panel holds
+	// it off too; right after a key, the pacer doesn't wait long.
+	if (predict_key(&predict, term, k->c, now_ms()))
+		damaged();
 }
 
 static void
-set_mouse_coords(struct input_event ev)
+handle_move(struct evdev *_, int x, int y)
 {
-	float xf = (float)mouse_cell_x/max_cols, yf = (float)mouse_cell_y/max_rows;
-
-	if (ev.code == ABS_X) {
-		xf = (double)(ev.value - mouse_min_x) / mouse_max_x;
-	} else if (ev.code == ABS_Y) {
-		yf = (double)(ev.value - mouse_min_y) / mouse_max_y;
-	}
+	double xf = (double)(x - mouse_min_x) / mouse_max_x;
+	double yf = (double)(y - mouse_min_y) / mouse_max_y;
 
 	mouse_cell_x = xf * max_cols;
 	mouse_cell_y = yf * max_rows;
 
+#if 0
 	printf("x %d y %d\n", mouse_cell_x, mouse_cell_y);
+#endif
 }
 
 /** Gets the min and max X and Y coordinates for the mouse. */
@@ -341,155 +373,204 @@ get_mouse_region(struct evdev *evm)
 }
 
 static void
-handle_mouse(struct evdev *_, struct input_event ev)
+handle_button(struct evdev *_, struct input_event ev)
 {
+#if 0
 	printf("Event: %s %s %d\n",
 	       libevdev_event_type_get_name(ev.type),
 	       libevdev_event_code_get_name(ev.type, ev.code),
 	       ev.value);
+#endif
 
-	if (ev.type == EV_ABS) {
-		set_mouse_coords(ev);
-		return;
-	} else if (ev.type != EV_KEY) {
-		// ???
-		return;
-	}
-
-	term_emit_mouse_click(&term, mouse_cell_y + 1, mouse_cell_x + 1, 0);
+	// The position has already been updated for this frame, so the
+	// click goes where the button went down.
+	if (ev.value == 1)
+		term_emit_mouse_click(term, mouse_cell_y + 1, mouse_cell_x + 1, 0);
 }
 
 void
-draw(int fb)
+draw(void)
 {
-	// Write out contents of screen
-	static int last_row = 0;
-	static int last_col = 0;
-
-	// Redraw the cell that the cursor was last on
-	if (last_row != term.row || last_col != term.col)
-		draw_cell(fb, last_row, last_col);
-	last_row = term.row;
-	last_col = term.col;
-
-	// This function is kinda dense because we're doing damage tracking.
-	// Essentially this means that whenever a cell changes, we mark it as
-	// "damaged", and we need to repaint it.
-	// The loop below here goes through all damage entries (unsigned chars)
-	// and checks to see if there is any damage, and if there is, then we
-	// will repaint the affected cells.
-	int r, c;
-	for (int byt = 0; byt < DAMAGE_BYTES(&term); ++byt) {
-		if (!term.damage[byt])
-			// No damage branch. Keep on going.
-			continue;
-
-		term_damage_t p = term.damage[byt];
-
-		int idx = byt * DAMAGE_WIDTH; // Offset in bits
-		int bit;
-		while ((bit = __builtin_ffs(p)) != 0) {
-			bit -= 1; // lsb is 1
-
-			r = DAMAGE_ROW(&term, idx+bit);
-			c = DAMAGE_COL(&term, idx+bit);
-			draw_cell(fb, r, c);
-
-			// Unset the bit we drew.
-			p &= ~(1 << bit);
-		}
-
-		// Unmark the damage.
-		term.damage[byt] = 0;
-	}
-
-	// Always draw the cursor last.
-	// Might be wasting some cycles since it could have gotten drawn above,
-	// but whatever.
-	draw_cell(fb, term.row, term.col);
+	predict_show(&predict, term);
+	render_draw(renderer, term);
+	predict_hide(&predict, term);
 
 	// Handle refresh_next now.
-	// This takes *a lot* of time because e-ink is slow and from what I can
-	// see, fbink doesn't allow us to just say "hey refresh the screen and
-	// let us know when it's done".
-	// But then again, I'm tired, so there's a good chance that I am just
-	// not thinking of how to do that right now.
-	// Or alternatively, the way to do it is just not immediately obvious
-	// to me.
+	// The flash takes *a lot* of time because e-ink is slow, but we don't
+	// wait for it; the renderer lets us know when it's done through its
+	// fd, and until then it counts as in flight.
 	if (refresh_next) {
 		refresh_next = 0;
-
-		fbc.is_flashing = 1;
-		fbink_refresh(fb, 0, 0, 0, 0, &fbc);
-		fbink_wait_for_complete(fb, 0); // This is slow!
-		fbc.is_flashing = 0;
+		render_refresh(renderer, 0, 0, 0, 0, REFRESH_FLASH);
 	}
-
-	term_flip(&term);
 }
 
-int
-init_term(int rows, int cols, char *args[])
+/* Starts a shell in a new session. */
+static int
+spawn_session(struct session *sess)
 {
 	int slave;
-	if (term_init(&term, rows, cols, &slave) == -1)
-		die("failed to init terminal: %s\n", strerror(errno));
+	if (term_init(&sess->term, max_rows, max_cols, &slave) == -1)
+		return -1;
+	term_set_cellsize(&sess->term, cell_w, cell_h);
+
+	// Other sessions' shells have no business with this pty.
+	fcntl(sess->term.pty, F_SETFD, FD_CLOEXEC);
 
 	// Fork and start the process.
-	switch ((child_pid = fork())) {
+	switch ((sess->pid = fork())) {
 	case -1: goto fail; break;
 	case 0:	/* child */
-		close(term.pty);
-		handle_pty_child(slave, args[0], args);
+		close(sess->term.pty);
+		handle_pty_child(slave, shell_args[0], shell_args);
 		abort(); /* unreachable */
 		break;
 	default:/* parent */
-		// Close the slave, setup signals, and return.
+		// Close the slave and return.
 		close(slave);
-		signal(SIGCHLD, sigchld_handler);
 		break;
 	}
 
 	// Set the on_bell handler so we can flash the screen every now and
 	// then.
-	term.on_bell = bellhandler;
+	sess->term.on_bell = bellhandler;
+	sess->len = 0;
+	sess->dirty = 0;
+
+	if (export_name) {
+		// Not being able to export is not fatal.
+		char name[64];
+		snprintf(name, sizeof(name), "%s.%d", export_name, (int)(sess-sessions)+1);
+		if (export_init(&sess->export, name, &sess->term) == -1)
+			fprintf(stderr, "failed to export %s: %s\n", name, strerror(errno));
+	}
 
 	return 0;
 
 fail:
-	if (child_pid == -1) {
-		// This is the only time where it is okay to close both
-		// fds.
-		close(term.pty);
-		close(slave);
-	}
+	// This is the only time where it is okay to close both fds.
+	close(slave);
+	sess->pid = 0;
 
-	term_free(&term);
+	term_free(&sess->term);
 	return -1;
 }
 
-void
-readterm(void)
+/* Makes session n the active one, starting it if it isn't running. */
+static void
+switch_session(int n)
+{
+	assert(n >= 0 && n < MAX_SESSIONS);
+
+	if (!sessions[n].pid && spawn_session(&sessions[n]) == -1) {
+		fprintf(stderr, "failed to start session %d: %s\n", n+1, strerror(errno));
+		return;
+	}
+
+	active = &sessions[n];
+	term = &active->term;
+	predict_clear(&predict);
+
+	// Whatever is on screen belongs to the old session.
+	term_invalidate(term);
+	damaged();
+}
+
+/* Tears down a session whose shell has gone away.
+ * If it was the active session, another one is switched to, and if there are
+ * none left, inkterm exits. */
+static void
+close_session(struct session *sess)
+{
+	sess->pid = 0;
+	export_free(&sess->export);
+	term_free(&sess->term);
+
+	if (sess != active)
+		return;
+
+	for (int i = 0; i < MAX_SESSIONS; ++i) {
+		if (sessions[i].pid) {
+			switch_session(i);
+			return;
+		}
+	}
+
+	// Last session exited peacefully.
+	exit(0);
+}
+
+/* Reaps children that have exited and closes their sessions. */
+static void
+reap_sessions(void)
+{
+	int reason;
+	pid_t p;
+
+	child_exited = 0;
+
+	// WNOHANG is used here to, as you may have guessed, not hang us.
+	while ((p = waitpid(-1, &reason, WNOHANG)) > 0) {
+		for (int i = 0; i < MAX_SESSIONS; ++i)
+			if (sessions[i].pid == p)
+				close_session(&sessions[i]);
+	}
+}
+
+/* Reads from the pty of a session.
+ * Returns how many bytes were read, or -1 if the other side has gone away. */
+static int
+readterm(struct session *sess)
 {
-	static unsigned char buf[512] = {0};
-	static int len = 0;
 	int n, written;
 
 	// Read from the pty.
 	// We offset by len in case there is any data left over (probably an
 	// incomplete UTF-8 sequence)
-	if ((n = read(term.pty, buf+len, sizeof(buf)-len)) == -1)
+	if ((n = read(sess->term.pty, sess->buf+sess->len, sizeof(sess->buf)-sess->len)) == -1) {
+		// EIO means the slave side was closed.
+		if (errno == EIO)
+			return -1;
+		if (errno == EAGAIN)
+			return 0;
 		die("read: %s\n", strerror(errno));
+	}
 
 	// Write to the terminal emulator.
 	// There is potential for it to be an incomplete write, because again,
 	// UTF-8.
-	len += n;
-	written = term_write(&term, buf, len);
-	len -= written;
+	sess->len += n;
+	written = term_write(&sess->term, sess->buf, sess->len);
+	sess->len -= written;
 
 	// Move back if needed.
-	memmove(buf, buf+written, len);
+	memmove(sess->buf, sess->buf+written, sess->len);
+	return n;
+}
+
+/* Exports and draws whatever changed since the last frame. */
+static void
+frame(void)
+{
+	writing = 0;
+
+	for (int i = 0; i < MAX_SESSIONS; ++i) {
+		if (sessions[i].dirty && sessions[i].export.hdr)
+			export_update(&sessions[i].export, &sessions[i].term);
+		sessions[i].dirty = 0;
+	}
+
+	// The pacer needs to know how long drawing takes.
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	draw();
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+	uint64_t delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	pacer_drawn(&pacer, delta_us);
+#if 0
+	printf("draw took %" PRIu64 " us after waiting %d ms\n", delta_us, pacer.interval);
+#endif
 }
 
 int
@@ -500,19 +581,80 @@ main(int argc, char *argv[])
 	if (shell) {
 		args[0] = shell;
 	}
+	shell_args = args;
 
 	// Specified or automatically detected
 	char *event_file = NULL, *mouse_file = NULL;
 
+	// Carta panels have 16 gray levels.
+	int gray_levels = 16, dither = 0;
+
+	// How many panel updates a frame may turn into, and how far apart
+	// changes can be before they go out as separate updates.
+	int regions = REGION_DEFAULT_COUNT, slack = REGION_DEFAULT_SLACK;
+
+	// Waveform thresholds; see sched.h.
+	sched_init(&sched);
+
+	// Fast refreshes a part of the screen takes before it is cleaned up,
+	// and how many milliseconds of quiet to wait for before doing so.
+	int ghost_threshold = 32, ghost_idle = 2000;
+
+	// Bounds of how long to wait for output to settle before drawing,
+	// in milliseconds.
+	int pace_min = 1, pace_max = 40;
+
+	// How long to wait for the echo of a character that was shown before
+	// it came, in milliseconds, or 0 to always wait for it.
+	int echo_timeout = 0;
+
+	// Which keymap to use; xkb picks whatever is left out.
+	struct xkb_rule_names names = {0};
+
 	int opt;
-	while ((opt = getopt(argc, argv, "e:m:")) != -1) {
+	while ((opt = getopt(argc, argv, "de:f:g:k:l:m:p:q:r:s:w:x:")) != -1) {
 		switch (opt) {
+		case 'd': dither = 1; break;
 		case 'e': event_file = optarg; break;
+		case 'f': frame_deadline = atoi(optarg); break;
+		case 'g': gray_levels = atoi(optarg); break;
+		case 'k':
+			// rules:model:layout:variant:options
+			keymap_names(&names, optarg);
+			break;
+		case 'l': echo_timeout = atoi(optarg); break;
 		case 'm': mouse_file = optarg; break;
+		case 'p':
+			// min:max
+			if (sscanf(optarg, "%d:%d", &pace_min, &pace_max) != 2 || pace_min < 0)
+				die("-p wants min:max\n");
+			break;
+		case 'q':
+			// threshold:idle_ms
+			if (sscanf(optarg, "%d:%d", &ghost_threshold, &ghost_idle) != 2)
+				die("-q wants threshold:idle_ms\n");
+			break;
+		case 'r': regions = atoi(optarg); break;
+		case 's': slack = atoi(optarg); break;
+		case 'w':
+			// fast_cells:fast_rows:full_percent
+			if (sscanf(optarg, "%d:%d:%d", &sched.fast_cells, &sched.fast_rows, &sched.full_percent) != 3)
+				die("-w wants fast_cells:fast_rows:full_percent\n");
+			break;
+		case 'x': export_name = optarg; break;
 		default: die("unknown flag '%c'\n", opt);
 		}
 	}
 
+	if (gray_levels < 2 || gray_levels > 256)
+		die("gray levels must be between 2 and 256\n");
+	pacer_init(&pacer, pace_min, pace_max);
+	predict_init(&predict, echo_timeout);
+
+	if (regions < 1 || regions > REGION_MAX)
+		die("regions must be between 1 and %d\n", REGION_MAX);
+	term_set_graylevels(gray_levels, dither);
+
 	int fb = fbink_open();
 	if (!fb)
 		die("fbink_open failed: %s\n", strerror(errno));
@@ -528,22 +670,39 @@ main(int argc, char *argv[])
 
 	max_rows = s.max_rows;
 	max_cols = s.max_cols;
+	cell_w = s.font_w;
+	cell_h = s.font_h;
+
+	if ((renderer = render_fbink_new(fb, &fbc)) == NULL)
+		die("failed to init renderer: %s\n", strerror(errno));
+	region_init(&renderer->damage, regions, slack, renderer->damage.align);
+	renderer->sched = &sched;
+	if (ghost_init(&ghost, renderer->width, renderer->height, ghost_threshold, ghost_idle) == -1)
+		die("failed to init ghost tracking: %s\n", strerror(errno));
+	renderer->ghost = &ghost;
+
+	// Multi-core devices draw with a thread per core. There is no pool on
+	// single-core ones, so drawing happens right here.
+	renderer->pool = pool_new(0);
 
-	if (init_term(s.max_rows, s.max_cols, args) != 0)
-		die("failed to init vt: %s\n", strerror(errno));
+	signal(SIGCHLD, sigchld_handler);
 
-	if (setup_xkb() == -1)
+	// Start off in the first session.
+	switch_session(0);
+	if (!term)
+		die("failed to init vt\n");
+
+	if (setup_xkb(&names) == -1)
 		die("failed to init xkb: %s\n", strerror(errno));
 
-	struct evdev evk = {
-		.on_key = handle_key
-	};
-	if (evdev_init(&evk, event_file) == -1)
+	// Without -e, keyboards are attached as they are plugged in.
+	struct evdev_watch kbds;
+	if (evdev_watch_init(&kbds, event_file, handle_key) == -1)
 		die("failed to init evdev for kbd: %s\n", strerror(errno));
 
 	struct evdev evm = {
-		.on_key = handle_mouse,
-		.on_mouse = handle_mouse
+		.on_key = handle_button,
+		.on_move = handle_move
 	};
 	if (mouse_file) {
 		if (evdev_init(&evm, mouse_file) == -1)
@@ -551,18 +710,13 @@ main(int argc, char *argv[])
 		get_mouse_region(&evm);
 	}
 
-	struct pollfd pfds[] = {
-		{ .fd = term.pty, .events = POLLIN },
-		{ .fd = evk.fd, .events = POLLIN },
-		{ .fd = evm.fd, .events = POLLIN },
-	};
-
-	int pfd_count = sizeof(pfds)/sizeof(*pfds);
-	if (mouse_file == NULL) {
-		// We aren't going to bother too much if the mouse event file
-		// is missing.
-		pfd_count--;
-	}
+	// Input devices come first, then the renderer if it tells us about
+	// completed refreshes, followed by the pty of every running session.
+	// Keyboards are first of all, after whatever tells us about them.
+	struct pollfd pfds[3+EVDEV_KEYBOARDS_MAX+MAX_SESSIONS];
+	struct session *pfd_sess[3+EVDEV_KEYBOARDS_MAX+MAX_SESSIONS];
+	struct evdev *pfd_kbd[EVDEV_KEYBOARDS_MAX];
+	int pfd_count, pfd_kbds, pfd_nkbd, pfd_mouse, pfd_ptys, pfd_render;
 
 	// Main event loop.
 	// Note: writing controls whether we are waiting for more input or not.
@@ -570,9 +724,73 @@ main(int argc, char *argv[])
 	// sent to the VT before actually drawing; once the timeout is passed
 	// with no data, only then do we draw.
 	int rc;
-	int writing = 0;
 	for (;;) {
-		rc = poll(pfds, pfd_count, writing ? draw_timeout : -1);
+		if (child_exited)
+			reap_sessions();
+
+		pfd_count = 0;
+		if (kbds.fd != -1)
+			pfds[pfd_count++] = (struct pollfd){ .fd = kbds.fd, .events = POLLIN };
+
+		pfd_kbds = pfd_count;
+		for (int i = 0; i < EVDEV_KEYBOARDS_MAX; ++i) {
+			if (!kbds.kbd[i].ctx)
+				continue;
+			pfd_kbd[pfd_count-pfd_kbds] = &kbds.kbd[i];
+			pfds[pfd_count++] = (struct pollfd){ .fd = kbds.kbd[i].fd, .events = POLLIN };
+		}
+		pfd_nkbd = pfd_count - pfd_kbds;
+
+		pfd_mouse = -1;
+		if (mouse_file != NULL) {
+			// We aren't going to bother too much if the mouse event
+			// file is missing.
+			pfd_mouse = pfd_count;
+			pfds[pfd_count++] = (struct pollfd){ .fd = evm.fd, .events = POLLIN };
+		}
+
+		pfd_render = -1;
+		if (renderer->fd != -1) {
+			pfd_render = pfd_count;
+			pfds[pfd_count++] = (struct pollfd){ .fd = renderer->fd, .events = POLLIN };
+		}
+
+		pfd_ptys = pfd_count;
+		for (int i = 0; i < MAX_SESSIONS; ++i) {
+			if (!sessions[i].pid)
+				continue;
+			pfd_sess[pfd_count] = &sessions[i];
+			// Anything queued for the pty is written once there
+			// is room for it.
+			short events = POLLIN;
+			if (term_pending(&sessions[i].term))
+				events |= POLLOUT;
+			pfds[pfd_count++] = (struct pollfd){ .fd = sessions[i].term.pty, .events = events };
+		}
+
+		// If the panel is busy, there is no point in drawing more; wait
+		// for refreshes to complete instead.
+		// Once things have been quiet for long enough, ghosting is
+		// cleaned up.
+		int busy = renderer->inflight >= max_inflight;
+		int timeout = -1;
+		if (writing && !busy) {
+			int64_t now = now_ms(), left = frame_deadline - (now - undrawn_since);
+			timeout = pacer_interval(&pacer, now);
+			if (left < timeout)
+				timeout = left < 0 ? 0 : left;
+		} else if (!writing && !busy && ghost_pending(&ghost)) {
+			int64_t left = ghost.idle - (now_ms() - last_active);
+			timeout = left < 0 ? 0 : left;
+		}
+
+		// Typed characters that are shown but never echoed need to
+		// be taken back.
+		int echo_left = predict_timeout(&predict, now_ms());
+		if (echo_left != -1 && (timeout == -1 || echo_left < timeout))
+			timeout = echo_left;
+
+		rc = poll(pfds, pfd_count, timeout);
 		if (rc == -1) {
 			// EINTR is not a fatal error, and simply means that
 			// the call to poll was interrupted.
@@ -583,29 +801,35 @@ main(int argc, char *argv[])
 			break;
 		}
 
+		if (predict_timeout(&predict, now_ms()) == 0 && predict_update(&predict, term, now_ms()))
+			damaged();
+
 		// Check to see if this was a timeout after data was being
 		// written to the terminal.
-		if (rc == 0 && writing) {
+		if (rc == 0 && writing && !busy) {
 			// It was. Set timeout to infinity and draw.
-			writing = 0;
-
-#if 1
-			struct timespec start, end;
-			clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-			draw(fb);
-			clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-
-			uint64_t delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-			printf("draw took %ld us\n", delta_us);
-#else
-			draw(fb);
-#endif
+			frame();
 
 			// rc == 0 so there is nothing more to do.
 			continue;
 		}
 
-		if (mouse_file != NULL && pfds[2].revents & POLLIN) {
+		if (rc == 0 && timeout != -1 && !writing) {
+			render_clean(renderer);
+			continue;
+		}
+
+		// More output is here, but what we have has waited long enough.
+		// Draw it before reading any more, so streaming output shows up
+		// as it goes. If the panel can't keep up, frames are skipped
+		// and the next one shows the latest screen.
+		if (writing && !busy && now_ms() - undrawn_since >= frame_deadline)
+			frame();
+
+		if (pfd_render != -1 && pfds[pfd_render].revents & POLLIN)
+			render_reap(renderer);
+
+		if (pfd_mouse != -1 && pfds[pfd_mouse].revents & POLLIN) {
 			// Mouse event, probably
 			if (evdev_handle(&evm) == -1) {
 				perror("evdev_handle");
@@ -613,21 +837,77 @@ main(int argc, char *argv[])
 			}
 		}
 
-		if (pfds[1].revents & POLLIN) {
+		int detached = 0;
+		for (int i = 0; i < pfd_nkbd; ++i) {
+			if (!(pfds[pfd_kbds+i].revents & (POLLIN|POLLERR|POLLHUP)))
+				continue;
+
+			last_active = now_ms();
+			pacer_key(&pacer, last_active);
+
 			// Key press, probably
-			if (evdev_handle(&evk) == -1) {
+			if (evdev_handle(pfd_kbd[i]) == -1) {
 				perror("evdev_handle");
+				evdev_watch_detach(&kbds, pfd_kbd[i]);
+				++detached;
+			}
+		}
+
+		// The keyboard that was asked for is the only one there will
+		// be.
+		if (detached && kbds.fd == -1)
+			break;
+
+		// Keyboards coming and going. This comes after reading them,
+		// so one that is gone isn't read.
+		if (kbds.fd != -1 && pfds[0].revents & POLLIN) {
+			int n = evdev_watch_handle(&kbds);
+			if (n == -1) {
+				perror("evdev_watch_handle");
 				break;
 			}
+			detached += n;
 		}
 
-		if (pfds[0].revents & POLLIN) {
+		// Keys held on a keyboard that is gone are never let go.
+		if (detached)
+			release_keys();
+
+		for (int i = pfd_ptys; i < pfd_count; ++i) {
+			struct session *sess = pfd_sess[i];
+
+			// The session may have been closed while handling
+			// something else.
+			if (!sess->pid)
+				continue;
+
+			// Errors writing show up when reading too, so they
+			// are dealt with there.
+			if (pfds[i].revents & POLLOUT)
+				term_flush(&sess->term);
+
+			if (!(pfds[i].revents & (POLLIN|POLLHUP)))
+				continue;
+
 			// Activity from the pty.
-			readterm();
+			int n;
+			if ((n = readterm(sess)) == -1) {
+				close_session(sess);
+				continue;
+			}
 
 			// More data might be coming in, so wait before
 			// actually doing anything.
-			writing = 1;
+			// Background sessions are never drawn, but they may
+			// still need to be exported.
+			sess->dirty = 1;
+			if (sess == active || sess->export.hdr)
+				damaged();
+			if (sess == active) {
+				last_active = now_ms();
+				pacer_data(&pacer, last_active, n);
+				predict_update(&predict, term, last_active);
+			}
 		}
 	}
 
@@ -635,10 +915,18 @@ main(int argc, char *argv[])
 		perror("poll");
 
 	// Cleanup.
+	pool_free(renderer->pool);
+	renderer->free(renderer);
+	ghost_free(&ghost);
 	fbink_close(fb);
 	free_xkb();
-	evdev_free(&evk);
+	evdev_watch_free(&kbds);
 	if (mouse_file != NULL)
 		evdev_free(&evm);
-	term_free(&term);
+	for (int i = 0; i < MAX_SESSIONS; ++i) {
+		if (sessions[i].pid) {
+			export_free(&sessions[i].export);
+			term_free(&sessions[i].term);
+		}
+	}
 }
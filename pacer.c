@@ -0,0 +1,76 @@
+#include "pacer.h"
+
+/* Output coming in within this long of a key press counts as its echo, up to
+ * ECHO_BYTES of it. */
+#define ECHO_WINDOW 50
+#define ECHO_BYTES 256
+
+/* At this many bytes per millisecond, the pacer waits as long as it can. A
+ * 115200 baud serial line is about 11. */
+#define BULK_RATE 64.0
+
+/* Weight of the newest draw time in its moving average. */
+#define ALPHA 0.25
+
+/* The data rate is averaged over roughly this many milliseconds. */
+#define RATE_WINDOW 50.0
+
+void
+pacer_init(struct pacer *p, int min, int max)
+{
+	*p = (struct pacer){ .min = min, .max = max < min ? min : max };
+	p->interval = p->min;
+	p->last_key = p->last_data = INT64_MIN/2;
+}
+
+void
+pacer_key(struct pacer *p, int64_t now)
+{
+	p->last_key = now;
+	p->echo_bytes = 0;
+}
+
+void
+pacer_data(struct pacer *p, int64_t now, int n)
+{
+	if (now - p->last_key <= ECHO_WINDOW)
+		p->echo_bytes += n;
+
+	// Data that arrives in the same millisecond is lumped together, so
+	// a burst of reads doesn't look infinitely fast.
+	int64_t gap = now - p->last_data;
+	if (gap < 1) gap = 1;
+	if (gap > 1000) gap = 1000;
+	// The longer it has been since the last sample, the less the old
+	// average counts.
+	double w = gap / (gap + RATE_WINDOW);
+	p->rate += w * ((double)n/gap - p->rate);
+	p->last_data = now;
+}
+
+void
+pacer_drawn(struct pacer *p, int64_t cost_us)
+{
+	p->cost += ALPHA * (cost_us/1000.0 - p->cost);
+}
+
+int
+pacer_interval(struct pacer *p, int64_t now)
+{
+	// Echo goes out right away, unless the key set off a lot of output.
+	if (now - p->last_key <= ECHO_WINDOW && p->echo_bytes < ECHO_BYTES)
+		return p->interval = p->min;
+
+	// Otherwise wait longer the more is coming in, and never so little
+	// that drawing takes longer than waiting.
+	// A rate measured a long time ago doesn't say much anymore.
+	double rate = p->rate * RATE_WINDOW / (RATE_WINDOW + (now - p->last_data));
+	double load = rate / BULK_RATE;
+	if (load > 1) load = 1;
+
+	double wait = p->min + (p->max - p->min) * load;
+	if (wait < p->cost) wait = p->cost;
+	if (wait > p->max) wait = p->max;
+
+	return p->interval = (int)(wait + 0.5);
+}
@@ -0,0 +1,48 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+/** Decides how long to wait for the pty to go quiet before drawing.
+ *
+ * Right after a key press, whatever comes back is most likely the echo, which
+ * should be on screen as soon as possible. When a lot of output is coming in,
+ * waiting longer means drawing less often and getting through it faster.
+ * The pacer watches both, as well as how long drawing takes, and picks
+ * something in between min and max.
+ *
+ * All times are in milliseconds from the same monotonic clock.
+ */
+struct pacer {
+	/** Bounds of the wait. */
+	int min, max;
+
+	/** What pacer_interval picked last time, for tuning. */
+	int interval;
+
+	/* Everything below is private. */
+	int64_t last_key, last_data;
+	int echo_bytes;
+
+	/** Moving averages of pty bytes per millisecond and of draw time in
+	 * milliseconds. */
+	double rate, cost;
+};
+
+/** Sets up a pacer. */
+void pacer_init(struct pacer *p, int min, int max);
+
+/** Takes note of a key press. */
+void pacer_key(struct pacer *p, int64_t now);
+
+/** Takes note of n bytes coming in from the pty. */
+void pacer_data(struct pacer *p, int64_t now, int n);
+
+/** Takes note of how long a draw took, in microseconds. */
+void pacer_drawn(struct pacer *p, int64_t cost_us);
+
+/** Returns how long to wait for more data before drawing, and stores it in
+ * p->interval. */
+int pacer_interval(struct pacer *p, int64_t now);
+
+#endif /* PACER_H */
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct pool {
+	int n;
+	pthread_t threads[POOL_MAX-1];
+
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+
+	/** The job being run. Thread t runs job t+1 if it is below jobs; the
+	 * caller always runs job 0. */
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int jobs;
+
+	/** Bumped for every pool_run, so threads know there is a new job. */
+	unsigned gen;
+
+	/** Threads still running the current job. */
+	int busy;
+
+	int quit;
+};
+
+struct worker {
+	struct pool *p;
+	int id;
+};
+
+static void *
+worker(void *arg)
+{
+	struct pool *p = ((struct worker *)arg)->p;
+	int id = ((struct worker *)arg)->id;
+	free(arg);
+
+	unsigned gen = 0;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->gen == gen && !p->quit)
+			pthread_cond_wait(&p->start, &p->lock);
+		if (p->quit)
+			break;
+		gen = p->gen;
+
+		if (id+1 < p->jobs) {
+			pthread_mutex_unlock(&p->lock);
+			p->fn(p->arg, id+1);
+			pthread_mutex_lock(&p->lock);
+
+			if (--p->busy == 0)
+				pthread_cond_signal(&p->done);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+struct pool *
+pool_new(int n)
+{
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > POOL_MAX)
+		n = POOL_MAX;
+	if (n <= 1)
+		return NULL;
+
+	struct pool *p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	// The calling thread is one of the n.
+	for (p->n = 1; p->n < n; ++p->n) {
+		struct worker *w = malloc(sizeof(*w));
+		if (!w)
+			break;
+		*w = (struct worker){ .p = p, .id = p->n-1 };
+
+		if (pthread_create(&p->threads[p->n-1], NULL, worker, w) != 0) {
+			free(w);
+			break;
+		}
+	}
+
+	if (p->n == 1) {
+		pool_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+int
+pool_size(const struct pool *p)
+{
+	return p ? p->n : 1;
+}
+
+void
+pool_run(struct pool *p, void (*fn)(void *arg, int i), void *arg, int n)
+{
+	assert(n <= pool_size(p));
+
+	if (!p || n <= 1) {
+		for (int i = 0; i < n; ++i)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->jobs = n;
+	p->busy = n-1;
+	++p->gen;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	fn(arg, 0);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busy)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+pool_free(struct pool *p)
+{
+	if (!p)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->n-1; ++i)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+	free(p);
+}
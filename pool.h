@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* The most threads a pool has, counting the one that calls pool_run. */
+#define POOL_MAX 8
+
+/** A fixed set of threads that run jobs alongside the calling thread. */
+struct pool;
+
+/** Creates a pool of n threads, counting the caller, or one per CPU if n is 0.
+ *
+ * Returns NULL if there would only be one thread, in which case there is no
+ * point to a pool, or if it could not be created.
+ */
+struct pool *pool_new(int n);
+
+/** Returns how many threads a pool runs jobs on, or 1 if it is NULL. */
+int pool_size(const struct pool *p);
+
+/** Calls fn(arg, i) for every i from 0 to n-1, spread over the threads of the
+ * pool, and returns once they are all done.
+ * n must be no more than pool_size(p). If p is NULL, everything is run on the
+ * calling thread. */
+void pool_run(struct pool *p, void (*fn)(void *arg, int i), void *arg, int n);
+
+/** Stops the threads of a pool and frees it. */
+void pool_free(struct pool *p);
+
+#endif /* POOL_H */
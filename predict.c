@@ -0,0 +1,201 @@
+#define _XOPEN_SOURCE
+
+#include <string.h>
+#include <termios.h>
+#include <wchar.h>
+
+#include "predict.h"
+
+static inline struct cell *
+cell_at(struct term *term, int row, int col)
+{
+	return &term->cells[row*term->cols + col];
+}
+
+static inline int
+blank(const struct cell *cell)
+{
+	return (cell->c == 0 || cell->c == ' ') && !cell->img && cell->attr != ATTR_WIDEDUMMY;
+}
+
+/** Takes back predictions from i on, so what is really there gets drawn. */
+static void
+undo(struct predict *p, struct term *term, int i)
+{
+	for (int j = i; j < p->n; ++j)
+		term_damage(term, p->p[j].row, p->p[j].col);
+	p->n = i;
+}
+
+/** Drops the first n predictions, which have been echoed. */
+static void
+confirm(struct predict *p, int n)
+{
+	memmove(p->p, p->p+n, (p->n-n)*sizeof(*p->p));
+	p->n -= n;
+}
+
+void
+predict_init(struct predict *p, int timeout)
+{
+	*p = (struct predict){ .timeout = timeout < 0 ? 0 : timeout };
+}
+
+int
+predict_key(struct predict *p, struct term *term, rune c, int64_t now)
+{
+	if (!p->timeout)
+		return 0;
+
+	// A new line is a new chance for echo to be on.
+	if (c == '\r' || c == '\n') {
+		p->off = 0;
+		p->quiet = 1;
+		return 0;
+	}
+
+	// Anything that isn't a plain character could move the cursor, or do
+	// who knows what.
+	if (c < 0x20 || c == 0x7F || wcwidth(c) != 1) {
+		p->quiet = 1;
+		return 0;
+	}
+
+	if (p->off || p->quiet || p->n == PREDICT_MAX)
+		return 0;
+	if (term->state & (STATE_ALTSCREEN|STATE_MOUSE|STATE_WRAPNEXT))
+		return 0;
+
+	// Stay off the last column, so a prediction never wraps.
+	int row = term->row, col = p->n ? p->p[p->n-1].col+1 : term->col;
+	if (col >= term->cols-1)
+		return 0;
+
+	// Only predict at the end of a line, like at a shell prompt; in the
+	// middle of one, characters are probably inserted.
+	for (int x = col; x < term->cols; ++x)
+		if (!blank(cell_at(term, row, x)))
+			return 0;
+
+	// Programs that read whole lines with echo turned off are asking for
+	// a password.
+	struct termios tio;
+	if (tcgetattr(term->pty, &tio) == 0 && (tio.c_lflag & ICANON) && !(tio.c_lflag & ECHO))
+		return 0;
+
+	// The echo will look exactly like this, so copying the cell keeps any
+	// padding the same too.
+	struct prediction *q = &p->p[p->n++];
+	q->row = row;
+	q->col = col;
+	memcpy(&q->cell, cell_at(term, row, col), sizeof(q->cell));
+	q->cell.c = c;
+	q->cell.attr = term->attr;
+	q->cell.bg = term->bg;
+	q->cell.fg = term->fg;
+	q->cell.img = 0;
+	q->when = now;
+
+	return 1;
+}
+
+int
+predict_update(struct predict *p, struct term *term, int64_t now)
+{
+	int echoed = 0, undone = 0;
+
+	for (int i = 0; i < p->n; ++i) {
+		struct prediction *q = &p->p[i];
+		const struct cell *cell = cell_at(term, q->row, q->col);
+
+		// Anything that scrolls or leaves the line is too much to
+		// keep track of.
+		if (term->scrolled || term->row != q->row) {
+			undo(p, term, echoed);
+			undone = 1;
+			break;
+		}
+
+		if (cell->c == q->cell.c && !memcmp(cell, &q->cell, sizeof(*cell))) {
+			echoed = i+1;
+			continue;
+		}
+
+		// Not there yet.
+		if (term->col <= q->col && blank(cell))
+			break;
+
+		// Something else came out.
+		undo(p, term, i);
+		undone = 1;
+		break;
+	}
+
+	// Echoed predictions are drawn already.
+	confirm(p, echoed < p->n ? echoed : p->n);
+
+	if (p->n && now - p->p[0].when >= p->timeout) {
+		// No echo at all probably means echo is off.
+		undo(p, term, 0);
+		p->off = 1;
+		undone = 1;
+	}
+
+	if (!p->n)
+		p->quiet = 0;
+
+	return undone;
+}
+
+int
+predict_timeout(struct predict *p, int64_t now)
+{
+	if (!p->n)
+		return -1;
+
+	int64_t left = p->p[0].when + p->timeout - now;
+	return left < 0 ? 0 : left;
+}
+
+void
+predict_clear(struct predict *p)
+{
+	p->n = 0;
+	p->quiet = 0;
+}
+
+void
+predict_show(struct predict *p, struct term *term)
+{
+	if (!p->n)
+		return;
+
+	p->row = term->row;
+	p->col = term->col;
+
+	for (int i = 0; i < p->n; ++i) {
+		struct prediction *q = &p->p[i];
+		struct cell *cell = cell_at(term, q->row, q->col);
+
+		memcpy(&q->saved, cell, sizeof(*cell));
+		memcpy(cell, &q->cell, sizeof(*cell));
+		term_damage(term, q->row, q->col);
+	}
+
+	// The cursor goes after the last one, like it will after the echo.
+	term->row = p->p[p->n-1].row;
+	term->col = p->p[p->n-1].col+1;
+}
+
+void
+predict_hide(struct predict *p, struct term *term)
+{
+	if (!p->n)
+		return;
+
+	for (int i = p->n-1; i >= 0; --i)
+		memcpy(cell_at(term, p->p[i].row, p->p[i].col), &p->p[i].saved, sizeof(struct cell));
+
+	term->row = p->row;
+	term->col = p->col;
+}
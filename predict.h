@@ -0,0 +1,79 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "term.h"
+
+/* The most typed characters that can be waiting for their echo. */
+#define PREDICT_MAX 32
+
+/** Shows typed characters before the terminal program echoes them.
+ *
+ * While a shell is reading a line, what is typed is almost always echoed
+ * right back where the cursor is. Going through the pty, the program and a
+ * refresh takes long enough to notice on e-ink, so predictions are drawn
+ * right away instead, and checked against the real echo when it arrives. If it
+ * doesn't match, or doesn't arrive in time, the prediction is taken back.
+ *
+ * Predictions are put on the screen of term only while it is being drawn;
+ * everywhere else, term is what the program wrote. Once drawn, a prediction
+ * stays on the panel until the echo replaces it with the same thing.
+ *
+ * All times are in milliseconds from the same monotonic clock.
+ */
+struct predict {
+	/** How long the echo can take before a prediction is taken back, or 0
+	 * to never predict. */
+	int timeout;
+
+	/* Everything below is private. */
+	struct prediction {
+		int row, col;
+		struct cell cell;
+
+		/** What was really in the cell while it is being drawn. */
+		struct cell saved;
+
+		int64_t when;
+	} p[PREDICT_MAX];
+	int n;
+
+	/** Set when echo seems to be off, until the next line. */
+	int off;
+
+	/** Set after a key whose echo can't be predicted, until the program
+	 * has written something and nothing is pending. */
+	int quiet;
+
+	/** Where the cursor really is while predictions are shown. */
+	int row, col;
+};
+
+/** Sets up predictions that are taken back after timeout milliseconds. */
+void predict_init(struct predict *p, int timeout);
+
+/** Takes note of c being sent to the program behind term.
+ * Returns non-zero if it is predicted, and the screen should be drawn. */
+int predict_key(struct predict *p, struct term *term, rune c, int64_t now);
+
+/** Checks predictions against what the program wrote to term since.
+ * Predictions that turn out wrong are taken back.
+ * Returns non-zero if any were, and the screen should be drawn. */
+int predict_update(struct predict *p, struct term *term, int64_t now);
+
+/** Returns how long until the oldest prediction times out, or -1 if there
+ * are none. */
+int predict_timeout(struct predict *p, int64_t now);
+
+/** Drops all predictions, for example because term is going out of view.
+ * Nothing is redrawn. */
+void predict_clear(struct predict *p);
+
+/** Puts predictions on term for drawing. */
+void predict_show(struct predict *p, struct term *term);
+
+/** Takes them back off again after drawing. */
+void predict_hide(struct predict *p, struct term *term);
+
+#endif /* PREDICT_H */
@@ -0,0 +1,102 @@
+#include <limits.h>
+
+#include "region.h"
+
+static inline int
+min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static inline int
+max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+static inline struct region
+join(struct region a, struct region b)
+{
+	int x = min(a.x, b.x), y = min(a.y, b.y);
+	return (struct region){
+		.x = x, .y = y,
+		.w = max(a.x+a.w, b.x+b.w) - x,
+		.h = max(a.y+a.h, b.y+b.h) - y,
+	};
+}
+
+/** Returns non-zero if a and b are no more than slack pixels apart. */
+static inline int
+near(struct region a, struct region b, int slack)
+{
+	return a.x <= b.x+b.w+slack && b.x <= a.x+a.w+slack
+	    && a.y <= b.y+b.h+slack && b.y <= a.y+a.h+slack;
+}
+
+static inline long
+area(struct region a)
+{
+	return (long)a.w * a.h;
+}
+
+static inline void
+remove_at(struct region_set *set, int i)
+{
+	set->r[i] = set->r[--set->n];
+}
+
+void
+region_init(struct region_set *set, int max, int slack, int align)
+{
+	set->n = 0;
+	set->max = max < 1 ? 1 : max > REGION_MAX ? REGION_MAX : max;
+	set->slack = slack < 0 ? 0 : slack;
+	set->align = align < 1 ? 1 : align;
+}
+
+void
+region_add(struct region_set *set, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+
+	// Round out to the alignment. The union of aligned rectangles is
+	// aligned too, so this only needs doing once.
+	int x1 = (x + w + set->align-1) / set->align * set->align;
+	x = x / set->align * set->align;
+	struct region a = { .x = x, .y = y, .w = x1-x, .h = h };
+
+	// Swallow everything close enough. Growing may bring a into range of
+	// regions that were checked already, so start over every time.
+	for (int i = 0; i < set->n; ) {
+		if (near(a, set->r[i], set->slack)) {
+			a = join(a, set->r[i]);
+			remove_at(set, i);
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+
+	set->r[set->n++] = a;
+	if (set->n <= set->max)
+		return;
+
+	// Too many regions: merge the two that cost the least extra pixels.
+	// There are only a few, so checking every pair is fine.
+	int bi = 0, bj = 1;
+	long best = LONG_MAX;
+	for (int i = 0; i < set->n; ++i) {
+		for (int j = i+1; j < set->n; ++j) {
+			long cost = area(join(set->r[i], set->r[j])) - area(set->r[i]) - area(set->r[j]);
+			if (cost < best) {
+				best = cost;
+				bi = i;
+				bj = j;
+			}
+		}
+	}
+
+	set->r[bi] = join(set->r[bi], set->r[bj]);
+	remove_at(set, bj);
+}
@@ -0,0 +1,53 @@
+#ifndef REGION_H
+#define REGION_H
+
+/* The most regions a set can ever hold. */
+#define REGION_MAX 16
+
+/* Defaults for region_init. */
+#define REGION_DEFAULT_COUNT 4
+#define REGION_DEFAULT_SLACK 32
+
+/** A rectangle of pixels. */
+struct region {
+	int x, y, w, h;
+};
+
+/** A handful of rectangles that cover everything that was added to it.
+ *
+ * Rectangles that are close to each other are merged, so a frame that touched
+ * a lot of scattered cells goes out as a few larger panel updates instead of
+ * a lot of small ones, and the panel never has more than max of them to deal
+ * with.
+ */
+struct region_set {
+	/** There is room for one more than max, because a new region is
+	 * stored before the two that are cheapest to merge are. */
+	struct region r[REGION_MAX+1];
+	int n;
+
+	/** The most regions there will be, at most REGION_MAX. */
+	int max;
+
+	/** Rectangles less than this many pixels apart are merged. */
+	int slack;
+
+	/** The left and right edges of regions are rounded out to a multiple
+	 * of this, because some controllers want them that way. */
+	int align;
+};
+
+/** Sets up an empty region set. max is clamped to 1...REGION_MAX. */
+void region_init(struct region_set *set, int max, int slack, int align);
+
+/** Adds a rectangle to the set, merging as needed. */
+void region_add(struct region_set *set, int x, int y, int w, int h);
+
+/** Empties the set. */
+static inline void
+region_clear(struct region_set *set)
+{
+	set->n = 0;
+}
+
+#endif /* REGION_H */
@@ -0,0 +1,408 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "render.h"
+#include "term.h"
+
+/* Blank cells in the middle of a run are filled instead of drawn if there are
+ * at least this many of them, which is where a fill gets cheaper than
+ * splitting up the text around it. */
+#define BLANK_MIN 4
+
+/* A run of cells on the same row that share the same colors, and can be
+ * drawn with one call. */
+struct run {
+	int row, col, n;
+	uint32_t fg, bg;
+	rune *text;
+};
+
+/* A call to one of the drawing operations of a renderer. */
+struct op {
+	enum { OP_SPAN, OP_FILL, OP_TILE } type;
+
+	/** Cells covered. */
+	int row, col, n;
+
+	/** Fills only use bg. */
+	uint32_t fg, bg;
+	const rune *text;
+
+	const uint8_t *tile;
+	int invert;
+};
+
+/* What render_draw is drawing.
+ * If ops is NULL, operations are done as soon as they are emitted. Otherwise
+ * they are collected, along with a copy of their text, to be done by the
+ * renderer's pool. */
+struct frame {
+	struct renderer *r;
+	struct run run;
+
+	struct op *ops;
+	int nops;
+	rune *text;
+	int ntext;
+
+	/** Where each band of ops starts; band i ends where i+1 starts. */
+	int bands[POOL_MAX+1];
+};
+
+static void
+do_op(struct renderer *r, const struct op *op)
+{
+	switch (op->type) {
+	case OP_SPAN:
+		r->draw_span(r, op->row, op->col, op->text, op->n, op->fg, op->bg);
+		break;
+	case OP_FILL:
+		r->fill_rect(r, r->ox + op->col*r->cw, r->oy + op->row*r->ch, op->n*r->cw, r->ch, op->bg);
+		break;
+	case OP_TILE:
+		r->draw_tile(r, op->row, op->col, op->tile, op->invert);
+		break;
+	}
+}
+
+static void
+emit(struct frame *f, struct op op)
+{
+	if (!f->ops) {
+		do_op(f->r, &op);
+		return;
+	}
+
+	// The run's text is reused for the next run, so it needs copying.
+	if (op.type == OP_SPAN) {
+		memcpy(&f->text[f->ntext], op.text, op.n*sizeof(*op.text));
+		op.text = &f->text[f->ntext];
+		f->ntext += op.n;
+	}
+
+	f->ops[f->nops++] = op;
+}
+
+/** Marks a cell as damaged so render_draw picks it up. */
+static inline void
+mark(struct term *term, int row, int col)
+{
+	if (row > term->rows-1 || col > term->cols-1) return;
+
+	int idx = row*term->cols + col;
+	term->damage[idx / DAMAGE_WIDTH] |= (term_damage_t)(1) << (idx % DAMAGE_WIDTH);
+}
+
+static inline int
+blank(rune c)
+{
+	return c == 0 || c == ' ';
+}
+
+/** Draws a run. Stretches of blank cells are filled in the background color
+ * rather than drawn as glyphs, which is what most of a cleared screen or
+ * line is. */
+static void
+flush(struct frame *f)
+{
+	struct renderer *r = f->r;
+	struct run *run = &f->run;
+	struct op span = { .type = OP_SPAN, .row = run->row, .fg = run->fg, .bg = run->bg };
+
+	if (!run->n)
+		return;
+
+	int x = r->ox + run->col*r->cw, y = r->oy + run->row*r->ch;
+	region_add(&r->damage, x, y, run->n*r->cw, r->ch);
+
+	int start = 0;
+	for (int i = 0; i < run->n; ) {
+		if (!blank(run->text[i])) {
+			++i;
+			continue;
+		}
+
+		int end = i;
+		while (end < run->n && blank(run->text[end]))
+			++end;
+
+		// Short stretches between words stay a part of the text,
+		// unless there is no text at all.
+		if (end-i < BLANK_MIN && !(i == 0 && end == run->n)) {
+			i = end;
+			continue;
+		}
+
+		if (i > start) {
+			span.col = run->col+start;
+			span.n = i-start;
+			span.text = &run->text[start];
+			emit(f, span);
+		}
+		emit(f, (struct op){ .type = OP_FILL, .row = run->row, .col = run->col+i, .n = end-i, .bg = run->bg });
+		start = i = end;
+	}
+
+	if (start < run->n) {
+		span.col = run->col+start;
+		span.n = run->n-start;
+		span.text = &run->text[start];
+		emit(f, span);
+	}
+
+	run->n = 0;
+}
+
+/** Adds the cell at row/col to run, drawing the run first if the cell can't
+ * be a part of it. */
+static void
+render_cell(struct frame *f, struct term *term, int y, int x)
+{
+	struct renderer *r = f->r;
+	struct run *run = &f->run;
+	struct cell *cell = &term->cells[(y*term->cols)+x];
+
+	const uint8_t *tile = term_tile(term, cell);
+	if (tile) {
+		flush(f);
+		emit(f, (struct op){
+			.type = OP_TILE, .row = y, .col = x, .n = 1, .tile = tile,
+			.invert = !!(cell->attr & ATTR_REVERSE) ^ (x == term->col && y == term->row),
+		});
+		region_add(&r->damage, r->ox + x*r->cw, r->oy + y*r->ch, r->cw, r->ch);
+		return;
+	}
+
+	// The dummy cell after a wide character is a blank in the colors of
+	// the wide character; its own colors are whatever was there before.
+	rune c = cell->c;
+	struct cell *style = cell;
+	if (cell->attr == ATTR_WIDEDUMMY) {
+		c = 0;
+		if (x > 0)
+			style = cell-1;
+	}
+
+	uint32_t fg = style->fg, bg = style->bg;
+	if (!!(style->attr & ATTR_REVERSE) ^ (x == term->col && y == term->row)) {
+		fg = style->bg;
+		bg = style->fg;
+	}
+
+	if (run->n && (run->row != y || run->col+run->n != x || run->fg != fg || run->bg != bg))
+		flush(f);
+
+	if (!run->n) {
+		run->row = y;
+		run->col = x;
+		run->fg = fg;
+		run->bg = bg;
+	}
+
+	run->text[run->n++] = c;
+}
+
+/** Splits the ops of a frame into up to n bands of whole rows, with about the
+ * same number of cells in each.
+ * Returns how many bands there are. */
+static int
+partition(struct frame *f, int n)
+{
+	long total = 0;
+	for (int i = 0; i < f->nops; ++i)
+		total += f->ops[i].n;
+
+	int bands = 0;
+	long acc = 0;
+	f->bands[bands++] = 0;
+	for (int i = 0; i < f->nops && bands < n; ++i) {
+		acc += f->ops[i].n;
+
+		// Rows can't be split between bands, since backends keep
+		// track of what changed a row at a time.
+		if (acc*n >= total*bands && i+1 < f->nops && f->ops[i+1].row != f->ops[i].row)
+			f->bands[bands++] = i+1;
+	}
+	f->bands[bands] = f->nops;
+
+	return bands;
+}
+
+static void
+draw_band(void *arg, int band)
+{
+	struct frame *f = arg;
+
+	for (int i = f->bands[band]; i < f->bands[band+1]; ++i)
+		do_op(f->r, &f->ops[i]);
+}
+
+/** Does the ops collected in a frame, spread over the renderer's pool. */
+static void
+draw_parallel(struct frame *f)
+{
+	struct renderer *r = f->r;
+
+	// Glyphs have to be rasterized up front, because that can't be done
+	// from more than one thread. If there are too many to keep around at
+	// once, it all has to be done the slow way.
+	int ok = 1;
+	for (int i = 0; i < f->nops && ok; ++i) {
+		struct op *op = &f->ops[i];
+		if (op->type == OP_SPAN && r->warm(r, op->row, op->col, op->text, op->n, op->fg, op->bg) == -1)
+			ok = 0;
+	}
+
+	if (!ok) {
+		for (int i = 0; i < f->nops; ++i)
+			do_op(r, &f->ops[i]);
+		return;
+	}
+
+	pool_run(r->pool, draw_band, f, partition(f, pool_size(r->pool)));
+}
+
+void
+render_free(struct renderer *r)
+{
+	free(r->ops);
+	free(r->text);
+	r->ops = NULL;
+	r->text = NULL;
+	r->cells = 0;
+}
+
+uint32_t
+render_refresh(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	if (r->ghost)
+		ghost_note(r->ghost, x, y, w, h, flags);
+	return r->refresh(r, x, y, w, h, flags);
+}
+
+void
+render_clean(struct renderer *r)
+{
+	if (!r->ghost || !ghost_pending(r->ghost))
+		return;
+
+	struct region_set set;
+	region_init(&set, r->damage.max, r->damage.slack, r->damage.align);
+	ghost_collect(r->ghost, &set);
+
+	for (int i = 0; i < set.n; ++i) {
+		struct region *reg = &set.r[i];
+
+		int x1 = reg->x + reg->w, y1 = reg->y + reg->h;
+		if (x1 > r->width) x1 = r->width;
+		if (y1 > r->height) y1 = r->height;
+		render_refresh(r, reg->x, reg->y, x1 - reg->x, y1 - reg->y, REFRESH_QUALITY);
+	}
+}
+
+int
+render_reap(struct renderer *r)
+{
+	uint32_t marker;
+	int n = 0;
+
+	// Backends write the marker of every refresh that completes.
+	while (r->fd != -1 && read(r->fd, &marker, sizeof(marker)) == sizeof(marker)) {
+		if (r->inflight > 0)
+			--r->inflight;
+		++n;
+	}
+
+	return n;
+}
+
+void
+render_draw(struct renderer *r, struct term *term)
+{
+	assert(r->cw == term->cw && r->ch == term->ch);
+
+	// The cell that the cursor was last on and the one it is on now need
+	// to be drawn, whether they changed or not.
+	mark(term, r->last_row, r->last_col);
+	mark(term, term->row, term->col);
+	r->last_row = term->row;
+	r->last_col = term->col;
+
+	rune text[term->cols];
+	struct frame f = { .r = r, .run = { .text = text } };
+
+	// With a pool, drawing is held off until everything that needs
+	// drawing is known, so it can be split up. There is room for that
+	// once per size of terminal; no memory just means drawing on this
+	// thread.
+	int cells = term->rows*term->cols;
+	if (r->pool && r->warm && r->cells < cells) {
+		render_free(r);
+		r->ops = malloc(cells*sizeof(*r->ops));
+		r->text = malloc(cells*sizeof(*r->text));
+		if (r->ops && r->text)
+			r->cells = cells;
+	}
+	if (r->pool && r->warm && r->cells >= cells) {
+		f.ops = r->ops;
+		f.text = r->text;
+	}
+
+	// This function is kinda dense because we're doing damage tracking.
+	// Essentially this means that whenever a cell changes, we mark it as
+	// "damaged", and we need to repaint it.
+	// The loop below here goes through all damage entries and checks to
+	// see if there is any damage, and if there is, then we will repaint
+	// the affected cells.
+	// Damaged cells next to each other in the same colors are collected
+	// into runs, so they can be drawn all at once.
+	int row, col;
+	for (int byt = 0; byt < DAMAGE_LEN(term); ++byt) {
+		if (!term->damage[byt])
+			// No damage branch. Keep on going.
+			continue;
+
+		term_damage_t p = term->damage[byt];
+
+		int idx = byt * DAMAGE_WIDTH; // Offset in bits
+		int bit;
+		while ((bit = __builtin_ffs(p)) != 0) {
+			bit -= 1; // lsb is 1
+
+			// Unset the bit we drew.
+			p &= ~(1 << bit);
+
+			if (idx+bit >= DAMAGE_BITS(term))
+				break;
+
+			row = DAMAGE_ROW(term, idx+bit);
+			col = DAMAGE_COL(term, idx+bit);
+			render_cell(&f, term, row, col);
+		}
+
+		// Unmark the damage.
+		term->damage[byt] = 0;
+	}
+
+	flush(&f);
+	if (f.ops)
+		draw_parallel(&f);
+
+	// Now that the whole frame is drawn, show it in as few updates as the
+	// damage allows.
+	for (int i = 0; i < r->damage.n; ++i) {
+		struct region *reg = &r->damage.r[i];
+
+		// Alignment may have pushed the edges off the screen.
+		int x1 = reg->x + reg->w, y1 = reg->y + reg->h;
+		if (x1 > r->width) x1 = r->width;
+		if (y1 > r->height) y1 = r->height;
+		int flags = r->sched ? sched_classify(r->sched, term, reg, r->cw, r->ch, r->ox, r->oy) : 0;
+		render_refresh(r, reg->x, reg->y, x1 - reg->x, y1 - reg->y, flags);
+	}
+	region_clear(&r->damage);
+
+	term_flip(term);
+}
@@ -0,0 +1,178 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdio.h>
+
+#include "ghost.h"
+#include "pool.h"
+#include "region.h"
+#include "sched.h"
+#include "term.h"
+
+/* Flags for refresh. */
+#define REFRESH_FLASH		(1 << 0)
+
+/* Waveform hints for refresh. Without any of these the backend picks. */
+#define REFRESH_FAST		(1 << 1) // fast and ghosty, for typing
+#define REFRESH_TEXT		(1 << 2) // for text that moves around
+#define REFRESH_QUALITY		(1 << 3) // all gray levels, for images
+#define REFRESH_WAVEFORM	(REFRESH_FAST|REFRESH_TEXT|REFRESH_QUALITY)
+
+/** A renderer puts the contents of a terminal on some kind of display.
+ *
+ * Backends fill in the operations and the geometry; the code in render.c
+ * decides what to draw and calls them. Coordinates passed to the pixel based
+ * operations are relative to the top left of the screen, not of the grid.
+ *
+ * Drawing operations only change pixels; nothing shows up on the panel until
+ * refresh is called for them.
+ */
+struct renderer {
+	/** Size of a cell in pixels. */
+	int cw, ch;
+
+	/** Pixel position of the top left corner of the grid. */
+	int ox, oy;
+
+	/** Size of the screen in pixels. */
+	int width, height;
+
+	/** Draws n cells of text starting at row/col, all in the same colors.
+	 * A rune of 0 is drawn as a blank cell. */
+	void (*draw_span)(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg);
+
+	/** Makes sure that drawing text in the given colors won't need
+	 * anything rasterized, because draw_span is about to be called for it
+	 * from several threads at once.
+	 * Returns -1 if that can't be done, for example because the glyphs
+	 * don't all fit in the glyph cache.
+	 * May be NULL if the drawing operations can't be called from more
+	 * than one thread, as long as each is drawing different rows. */
+	int (*warm)(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg);
+
+	/** Draws an image tile (see term_tile) into the cell at row/col. */
+	void (*draw_tile)(struct renderer *r, int row, int col, const uint8_t *tile, int invert);
+
+	/** Fills a rectangle of pixels with a color. */
+	void (*fill_rect)(struct renderer *r, int x, int y, int w, int h, uint32_t color);
+
+	/** Moves a rectangle of pixels by dx/dy.
+	 * May be NULL if the backend can't read back what it has drawn. */
+	void (*move_rect)(struct renderer *r, int x, int y, int w, int h, int dx, int dy);
+
+	/** Shows a region of pixels on the panel, or the whole screen if w or h
+	 * is 0.
+	 * Returns a marker that can be passed to wait. */
+	uint32_t (*refresh)(struct renderer *r, int x, int y, int w, int h, int flags);
+
+	/** Waits for the refresh with marker to complete, or the last one if
+	 * marker is 0.
+	 * This blocks; see fd for finding out without waiting. */
+	void (*wait)(struct renderer *r, uint32_t marker);
+
+	/** Frees the renderer. */
+	void (*free)(struct renderer *r);
+
+	/** Becomes readable when refreshes complete, at which point
+	 * render_reap should be called. -1 if the backend doesn't track
+	 * completion, in which case inflight is always 0. */
+	int fd;
+
+	/** Refreshes that have been sent to the panel but have not completed
+	 * yet. */
+	int inflight;
+
+	/** Where the cursor was drawn last. */
+	int last_row, last_col;
+
+	/** What render_draw drew in the current frame, which it refreshes
+	 * once everything is drawn. Backends set this up; the count and
+	 * slack can be changed afterwards. */
+	struct region_set damage;
+
+	/** Picks waveforms for the refreshes of a frame, or NULL to leave it
+	 * up to the backend. */
+	const struct sched *sched;
+
+	/** Keeps track of ghosting left behind by refreshes, or NULL. */
+	struct ghost *ghost;
+
+	/** Threads to draw on, or NULL to draw on the calling thread.
+	 * Only used if the backend has warm. */
+	struct pool *pool;
+
+	/* Everything below is private to render.c. */
+
+	/** What is collected for the pool in a frame, which is kept from one
+	 * frame to the next so drawing doesn't allocate. */
+	struct op *ops;
+	rune *text;
+	int cells;
+};
+
+/* Dithering is lined up with the screen, like fills and images, so that
+ * dithered cells have no seams between them. A backend that caches dithered
+ * cells needs a copy for every place in the 4x4 pattern a cell can start at,
+ * which goes in the otherwise unused top byte of the colors it is cached
+ * under. */
+#define RENDER_PHASE_SHIFT 24
+
+/** Returns where in the dither pattern the cell at row/col starts, to be put
+ * into the colors a dithered cell is cached under. */
+static inline uint32_t
+render_phase(const struct renderer *r, int row, int col)
+{
+	int x = r->ox + col*r->cw, y = r->oy + row*r->ch;
+	return (uint32_t)((x & 3) | (y & 3) << 2) << RENDER_PHASE_SHIFT;
+}
+
+/** Takes the phase back out of the colors of a cached cell, and returns how
+ * far into the dither pattern it starts in px and py. */
+static inline void
+render_unphase(uint32_t *fg, uint32_t *bg, int *px, int *py)
+{
+	*px = (*fg >> RENDER_PHASE_SHIFT) & 3;
+	*py = (*fg >> RENDER_PHASE_SHIFT) >> 2;
+	*fg &= (1u << RENDER_PHASE_SHIFT) - 1;
+	*bg &= (1u << RENDER_PHASE_SHIFT) - 1;
+}
+
+/** Draws everything on term that has been damaged since the last call, as
+ * well as the cursor, refreshes the parts of the screen that changed, and then
+ * flips term. */
+void render_draw(struct renderer *r, struct term *term);
+
+/** Refreshes a region of the screen like r->refresh, and takes note of it
+ * for r->ghost. */
+uint32_t render_refresh(struct renderer *r, int x, int y, int w, int h, int flags);
+
+/** Cleans up ghosting with quality refreshes of the parts of the screen that
+ * r->ghost says need it. Does nothing if there is no r->ghost. */
+void render_clean(struct renderer *r);
+
+/** Frees what render_draw keeps around in r. Backends call this when they
+ * are freed. */
+void render_free(struct renderer *r);
+
+/** Takes note of refreshes that have completed, once r->fd is readable.
+ * Returns how many did. */
+int render_reap(struct renderer *r);
+
+/** Creates a renderer that draws into 8-bit gray pixels in memory, for
+ * testing and benchmarking off the device.
+ * refresh and wait do nothing.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+struct renderer *render_mem_new(int rows, int cols, int cw, int ch);
+
+/** Returns the pixels of a memory renderer, which are r->width bytes per
+ * row. */
+uint8_t *render_mem_pixels(struct renderer *r);
+
+/** Writes the pixels of a memory renderer to f as a binary PGM.
+ *
+ * Returns -1 on error and sets errno. */
+int render_mem_dump(struct renderer *r, FILE *f);
+
+#endif /* RENDER_H */
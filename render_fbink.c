@@ -0,0 +1,552 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fbink.h>
+
+#include "boxdraw.h"
+#include "glyph.h"
+#include "render_fbink.h"
+#include "utf8.h"
+
+/* The most refreshes the waiter thread keeps track of at once. */
+#define PENDING_MAX 64
+
+struct fbink_renderer {
+	struct renderer r;
+
+	int fb;
+	FBInkConfig *cfg;
+
+	/** Text being printed, as UTF-8. */
+	char *buf;
+	size_t bufsz;
+
+	/** Set if cells can be copied straight into the framebuffer, which is
+	 * fbp with stride bytes per row and bpp bytes per pixel. */
+	int direct;
+	uint8_t *fbp;
+	size_t stride;
+	int bpp;
+	int inverted;
+
+	/** A copy of the framebuffer in regular memory, height rows of stride
+	 * bytes, which is drawn into instead of the framebuffer itself.
+	 * Pixels between dirty0 and dirty1 on each row have changed since
+	 * they were last copied over; see flush. */
+	uint8_t *shadow;
+	int height;
+	int *dirty0, *dirty1;
+
+	/** Scratch space for one cell of box drawing. */
+	uint8_t *mask;
+
+	/** Cells that fbink has drawn before, see fbink_raster. */
+	struct glyph_cache glyphs;
+
+	/** The cell that is being drawn. */
+	int row, col;
+
+	/** What fbink's pens are set to. */
+	int pens_set;
+	uint8_t pen_fg, pen_bg;
+
+	/** The waiter thread waits for the markers in pending to complete,
+	 * and writes each one to done[1] once it has. */
+	int waiting;
+	pthread_t waiter;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t pending[PENDING_MAX];
+	int head, count, quit;
+	int done[2];
+};
+
+/** Sets fbink's pens, if they aren't set to these colors already. */
+static void
+set_pens(struct fbink_renderer *f, uint32_t fg, uint32_t bg)
+{
+	// fbink can't draw our dither patterns, so it gets the base level.
+	if (!f->pens_set || f->pen_fg != COLOR_GRAY(fg))
+		fbink_set_fg_pen_gray(COLOR_GRAY(fg), 0, 1);
+	if (!f->pens_set || f->pen_bg != COLOR_GRAY(bg))
+		fbink_set_bg_pen_gray(COLOR_GRAY(bg), 0, 1);
+
+	f->pens_set = 1;
+	f->pen_fg = COLOR_GRAY(fg);
+	f->pen_bg = COLOR_GRAY(bg);
+}
+
+/** Stores text as a NUL terminated UTF-8 string in f->buf.
+ * Returns -1 if memory could not be allocated. */
+static int
+encode(struct fbink_renderer *f, const rune *text, int n)
+{
+	// Every rune takes at most 4 bytes, plus one for NUL.
+	if (f->bufsz < n*4+1) {
+		char *buf = realloc(f->buf, n*4+1);
+		if (!buf)
+			return -1;
+		f->buf = buf;
+		f->bufsz = n*4+1;
+	}
+
+	size_t len = 0;
+	for (int i = 0; i < n; ++i) {
+		if (text[i])
+			len += utf8_encodeto(text[i], (unsigned char *)f->buf+len, 4);
+		else
+			f->buf[len++] = ' ';
+	}
+	f->buf[len] = 0;
+
+	return 0;
+}
+
+/** Returns where the cell at row/col starts in the framebuffer. */
+static inline uint8_t *
+fb_cell(struct fbink_renderer *f, int row, int col)
+{
+	return f->fbp + (f->r.oy + row*f->r.ch)*f->stride + (f->r.ox + col*f->r.cw)*f->bpp;
+}
+
+/** Stores gray level g as a pixel in the framebuffer's format at out, the same
+ * way fbink does. */
+static inline void
+pack_gray(struct fbink_renderer *f, uint8_t g, uint8_t *out)
+{
+	switch (f->bpp) {
+	case 1:
+		out[0] = f->inverted ? 0xFF - g : g;
+		break;
+	case 2: {
+		uint16_t px = ((g >> 3) << 11) | ((g >> 2) << 5) | (g >> 3);
+		memcpy(out, &px, 2);
+		break;
+	}
+	default:
+		// BGR(A); gray is the same in every channel.
+		memset(out, g, 3);
+		if (f->bpp == 4)
+			out[3] = 0xFF;
+		break;
+	}
+}
+
+/** Copies w*bpp bytes from src to pixel x, y of the shadow framebuffer, and
+ * marks them dirty if they are any different from what is there. */
+static inline void
+shadow_put(struct fbink_renderer *f, int x, int y, const uint8_t *src, int w)
+{
+	uint8_t *dst = f->shadow + y*f->stride + x*f->bpp;
+	size_t len = w*f->bpp;
+
+	if (memcmp(dst, src, len) == 0)
+		return;
+	memcpy(dst, src, len);
+
+	if (f->dirty0[y] > x) f->dirty0[y] = x;
+	if (f->dirty1[y] < x+w) f->dirty1[y] = x+w;
+}
+
+/** Copies every dirty span of the shadow framebuffer to the real one, a row at
+ * a time. */
+static void
+flush(struct fbink_renderer *f)
+{
+	for (int y = 0; y < f->height; ++y) {
+		if (f->dirty0[y] >= f->dirty1[y])
+			continue;
+
+		size_t off = y*f->stride + f->dirty0[y]*f->bpp;
+		memcpy(f->fbp + off, f->shadow + off, (f->dirty1[y]-f->dirty0[y])*f->bpp);
+
+		f->dirty0[y] = f->r.width;
+		f->dirty1[y] = 0;
+	}
+}
+
+/* Rasterizes a glyph for the cache.
+ * There is no way to ask fbink for a glyph, so it draws it in the cell that
+ * is about to get it anyway and we copy it out of the framebuffer. */
+static int
+fbink_raster(void *ctx, rune c, uint32_t fg, uint32_t bg, uint8_t *out)
+{
+	struct fbink_renderer *f = ctx;
+	int px, py;
+
+	render_unphase(&fg, &bg, &px, &py);
+
+	// Box drawing doesn't need fbink at all, which also means its lines
+	// meet up no matter what the font looks like. Lines only get base
+	// levels, like text does from the pens; shades are dithered in line
+	// with the screen, see render_phase.
+	if (boxdraw_raster(c, f->mask, f->r.cw, f->r.ch)) {
+		for (int y = 0; y < f->r.ch; ++y) {
+			for (int x = 0; x < f->r.cw; ++x) {
+				uint8_t a = f->mask[y*f->r.cw + x];
+				uint8_t g = a == 0 ? COLOR_GRAY(bg) : a == 0xFF ? COLOR_GRAY(fg)
+					: color_at(term_mix(fg, bg, a), px+x, py+y);
+				pack_gray(f, g, out + (y*f->r.cw + x)*f->bpp);
+			}
+		}
+		return 0;
+	}
+
+	if (encode(f, &c, 1) == -1)
+		return -1;
+
+	set_pens(f, fg, bg);
+
+	f->cfg->row = f->row;
+	f->cfg->col = f->col;
+	f->cfg->is_inverted = 0;
+	fbink_print(f->fb, f->buf, f->cfg);
+
+	uint8_t *src = fb_cell(f, f->row, f->col);
+	size_t len = f->r.cw*f->bpp;
+	for (int y = 0; y < f->r.ch; ++y)
+		memcpy(out + y*len, src + y*f->stride, len);
+
+	return 0;
+}
+
+static void
+fbink_draw_span(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+
+	if (f->direct) {
+		// Glyphs go into the shadow framebuffer a line of pixels at a
+		// time, and only the lines that changed get copied over later.
+		int x = r->ox + col*r->cw, y = r->oy + row*r->ch;
+		size_t len = r->cw*f->bpp;
+
+		for (int i = 0; i < n; ++i, x += r->cw) {
+			// Text only gets base levels, so only shades depend on
+			// where they are.
+			uint32_t p = boxdraw_has(text[i]) ? render_phase(r, row, col+i) : 0;
+
+			// Only look it up first, so nothing changes if this is
+			// one of several threads drawing after fbink_warm.
+			const uint8_t *glyph = glyph_find(&f->glyphs, text[i], fg|p, bg|p);
+			if (!glyph) {
+				f->row = row;
+				f->col = col+i;
+				glyph = glyph_get(&f->glyphs, text[i], fg|p, bg|p);
+			}
+			if (!glyph)
+				continue;
+
+			for (int j = 0; j < r->ch; ++j)
+				shadow_put(f, x, y+j, glyph + j*len, r->cw);
+		}
+		return;
+	}
+
+	// The whole run goes out in one print.
+	set_pens(f, fg, bg);
+	if (encode(f, text, n) == -1)
+		return;
+
+	f->cfg->row = row;
+	f->cfg->col = col;
+	f->cfg->is_inverted = 0;
+	fbink_print(f->fb, f->buf, f->cfg);
+}
+
+static int
+fbink_warm(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+	unsigned flushes = f->glyphs.flushes;
+
+	// fbink_raster draws into the cell the glyph is for, which is about
+	// to be drawn over anyway.
+	f->row = row;
+	for (int i = 0; i < n; ++i) {
+		uint32_t p = boxdraw_has(text[i]) ? render_phase(r, row, col+i) : 0;
+		f->col = col+i;
+		glyph_get(&f->glyphs, text[i], fg|p, bg|p);
+	}
+
+	// Anything warmed before this may be gone.
+	return f->glyphs.flushes == flushes ? 0 : -1;
+}
+
+static void
+fbink_draw_tile(struct renderer *r, int row, int col, const uint8_t *tile, int invert)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+
+	if (f->direct) {
+		int x = r->ox + col*r->cw, y = r->oy + row*r->ch;
+		uint8_t line[r->cw*f->bpp];
+
+		for (int j = 0; j < r->ch; ++j) {
+			const uint8_t *src = &tile[j*r->cw];
+			for (int i = 0; i < r->cw; ++i)
+				pack_gray(f, invert ? 0xFF - src[i] : src[i], &line[i*f->bpp]);
+			shadow_put(f, x, y+j, line, r->cw);
+		}
+		return;
+	}
+
+	f->cfg->row = row;
+	f->cfg->col = col;
+	f->cfg->is_inverted = invert;
+
+	// Image tiles are already gray, so they go out as is.
+	fbink_print_raw_data(f->fb, tile, r->cw, r->ch, r->cw*r->ch, 0, 0, f->cfg);
+	f->cfg->is_inverted = 0;
+}
+
+static void
+fbink_fill_rect(struct renderer *r, int x, int y, int w, int h, uint32_t color)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+
+	if (f->direct) {
+		// Like fbink, this only uses the base level of the color.
+		uint8_t line[w*f->bpp];
+		for (int i = 0; i < w; ++i)
+			pack_gray(f, COLOR_GRAY(color), &line[i*f->bpp]);
+		for (int j = y; j < y+h; ++j)
+			shadow_put(f, x, j, line, w);
+		return;
+	}
+
+	FBInkRect rect = { .left = x, .top = y, .width = w, .height = h };
+
+	// fbink refreshes whatever it fills unless no_refresh is set, and
+	// blank stretches are filled one by one, so this makes sure a fill
+	// never turns into a panel update of its own. The 0 is no_rota:
+	// the rect is in the same rotated coordinates as everything else.
+	FBInkConfig cfg = *f->cfg;
+	cfg.no_refresh = 1;
+	fbink_fill_rect_gray(f->fb, &cfg, &rect, 0, COLOR_GRAY(color));
+}
+
+static uint32_t
+fbink_refresh_region(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+
+	// The panel can only show what is in the real framebuffer.
+	if (f->direct)
+		flush(f);
+
+	// DU only goes between black and white, but it's fast. GL16 keeps the
+	// grays without flashing, and GC16 flashes to get everything right.
+	switch (flags & REFRESH_WAVEFORM) {
+	case REFRESH_FAST: f->cfg->wfm_mode = WFM_DU; break;
+	case REFRESH_TEXT: f->cfg->wfm_mode = WFM_GL16; break;
+	case REFRESH_QUALITY: f->cfg->wfm_mode = WFM_GC16; break;
+	default: f->cfg->wfm_mode = WFM_AUTO; break;
+	}
+
+	// Everything else is drawn with no_refresh set; see render_fbink_new.
+	f->cfg->is_flashing = !!(flags & REFRESH_FLASH);
+	f->cfg->no_refresh = 0;
+	fbink_refresh(f->fb, y, x, w, h, f->cfg);
+	f->cfg->no_refresh = 1;
+	f->cfg->is_flashing = 0;
+	f->cfg->wfm_mode = WFM_AUTO;
+
+	uint32_t marker = fbink_get_last_marker();
+	if (!f->waiting)
+		return marker;
+
+	// Hand the marker to the waiter. If it somehow has too many already,
+	// this refresh just isn't counted.
+	pthread_mutex_lock(&f->lock);
+	if (f->count < PENDING_MAX) {
+		f->pending[(f->head + f->count++) % PENDING_MAX] = marker;
+		++r->inflight;
+		pthread_cond_signal(&f->cond);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return marker;
+}
+
+/* Waits for refreshes to complete, one after the other, so the main loop
+ * doesn't have to. */
+static void *
+fbink_waiter(void *arg)
+{
+	struct fbink_renderer *f = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&f->lock);
+		while (!f->count && !f->quit)
+			pthread_cond_wait(&f->cond, &f->lock);
+		if (f->quit) {
+			pthread_mutex_unlock(&f->lock);
+			return NULL;
+		}
+		uint32_t marker = f->pending[f->head];
+		f->head = (f->head+1) % PENDING_MAX;
+		--f->count;
+		pthread_mutex_unlock(&f->lock);
+
+		fbink_wait_for_complete(f->fb, marker);
+
+		// The pipe can hold far more markers than can be pending, so
+		// this doesn't block.
+		while (write(f->done[1], &marker, sizeof(marker)) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void
+fbink_wait(struct renderer *r, uint32_t marker)
+{
+	fbink_wait_for_complete(((struct fbink_renderer *)r)->fb, marker);
+}
+
+static void
+fbink_free(struct renderer *r)
+{
+	struct fbink_renderer *f = (struct fbink_renderer *)r;
+
+	if (f->waiting) {
+		pthread_mutex_lock(&f->lock);
+		f->quit = 1;
+		pthread_cond_signal(&f->cond);
+		pthread_mutex_unlock(&f->lock);
+
+		pthread_join(f->waiter, NULL);
+		pthread_mutex_destroy(&f->lock);
+		pthread_cond_destroy(&f->cond);
+		close(f->done[0]);
+		close(f->done[1]);
+	}
+
+	render_free(r);
+	glyph_free(&f->glyphs);
+	free(f->shadow);
+	free(f->dirty0);
+	free(f->dirty1);
+	free(f->mask);
+	free(f->buf);
+	free(f);
+}
+
+/* Sets up the shadow framebuffer, starting off with whatever is on screen.
+ * Returns 0 if memory could not be allocated. */
+static int
+shadow_init(struct fbink_renderer *f, size_t fbsize, size_t stride, int bpp)
+{
+	f->stride = stride;
+	f->bpp = bpp;
+	f->height = fbsize / stride;
+
+	f->shadow = malloc(fbsize);
+	f->dirty0 = malloc(f->height * sizeof(*f->dirty0));
+	f->dirty1 = calloc(f->height, sizeof(*f->dirty1));
+	f->mask = malloc(f->r.cw*f->r.ch);
+	if (!f->shadow || !f->dirty0 || !f->dirty1 || !f->mask)
+		return 0;
+
+	memcpy(f->shadow, f->fbp, fbsize);
+	for (int y = 0; y < f->height; ++y)
+		f->dirty0[y] = f->r.width;
+
+	return 1;
+}
+
+struct renderer *
+render_fbink_new(int fb, FBInkConfig *cfg)
+{
+	FBInkState s;
+	struct fbink_renderer *f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	f->fb = fb;
+	f->cfg = cfg;
+
+	fbink_get_state(cfg, &s);
+	f->r.cw = s.font_w;
+	f->r.ch = s.font_h;
+	f->r.width = s.screen_width;
+	f->r.height = s.screen_height;
+
+	// This is where fbink puts row 0, col 0 of its text grid.
+	f->r.ox = s.view_hori_origin;
+	f->r.oy = s.view_vert_origin + s.view_vert_offset;
+
+	f->r.draw_span = fbink_draw_span;
+	f->r.draw_tile = fbink_draw_tile;
+	f->r.fill_rect = fbink_fill_rect;
+	f->r.move_rect = NULL; // fbink has no way to do this
+	f->r.refresh = fbink_refresh_region;
+	f->r.wait = fbink_wait;
+	f->r.free = fbink_free;
+
+	// EPDC controllers want the horizontal edges of updates on 8 pixel
+	// boundaries, at least for the fast waveforms.
+	region_init(&f->r.damage, REGION_DEFAULT_COUNT, REGION_DEFAULT_SLACK, 8);
+
+	// Nothing is drawn to the panel until render_draw asks for it, so a
+	// frame goes out as a few updates instead of one per print.
+	cfg->no_refresh = 1;
+
+	// See if we can copy cells into the framebuffer ourselves.
+	// fbink draws a blank cell at 0, 0 to tell us where the grid is. If it
+	// had to rotate it or it isn't exactly one cell, cells aren't where we
+	// expect them to be and we leave all the drawing to fbink.
+	size_t fbsize;
+	f->fbp = fbink_get_fb_pointer(fb, &fbsize);
+
+	cfg->row = cfg->col = 0;
+	fbink_print(fb, " ", cfg);
+
+	FBInkRect cell = fbink_get_last_rect(0), rotated = fbink_get_last_rect(1);
+	f->glyphs.raster = fbink_raster;
+	f->glyphs.ctx = f;
+
+	if (f->fbp && s.bpp >= 8 && s.bpp % 8 == 0
+	    && memcmp(&cell, &rotated, sizeof(cell)) == 0
+	    && cell.width == s.font_w && cell.height == s.font_h
+	    && shadow_init(f, fbsize, s.scanline_stride, s.bpp/8)
+	    && glyph_init(&f->glyphs, s.font_w, s.font_h, s.bpp/8) == 0) {
+		f->direct = 1;
+		f->inverted = s.inverted_grayscale;
+
+		// Drawing is all in memory now, so it can be split between
+		// threads.
+		f->r.warm = fbink_warm;
+		f->r.ox = cell.left;
+		f->r.oy = cell.top;
+	}
+
+	// Completion is tracked by a thread if the device can tell us about
+	// it. Otherwise refreshes are fire and forget.
+	f->r.fd = -1;
+	if (s.can_wait_for_complete && pipe(f->done) == 0) {
+		fcntl(f->done[0], F_SETFL, O_NONBLOCK);
+		fcntl(f->done[0], F_SETFD, FD_CLOEXEC);
+		fcntl(f->done[1], F_SETFD, FD_CLOEXEC);
+
+		pthread_mutex_init(&f->lock, NULL);
+		pthread_cond_init(&f->cond, NULL);
+		if (pthread_create(&f->waiter, NULL, fbink_waiter, f) == 0) {
+			f->waiting = 1;
+			f->r.fd = f->done[0];
+		} else {
+			pthread_mutex_destroy(&f->lock);
+			pthread_cond_destroy(&f->cond);
+			close(f->done[0]);
+			close(f->done[1]);
+		}
+	}
+
+	return &f->r;
+}
@@ -0,0 +1,17 @@
+#ifndef RENDER_FBINK_H
+#define RENDER_FBINK_H
+
+#include <fbink.h>
+
+#include "render.h"
+
+/** Creates a renderer that draws to the framebuffer with fbink.
+ * fb and cfg must already be initialized, and must stay valid for as long as
+ * the renderer is in use. The renderer sets cfg->no_refresh, and leaves it set;
+ * the panel is only updated through refresh.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+struct renderer *render_fbink_new(int fb, FBInkConfig *cfg);
+
+#endif /* RENDER_FBINK_H */
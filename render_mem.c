@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boxdraw.h"
+#include "font.h"
+#include "glyph.h"
+#include "render.h"
+
+/* A renderer that draws into memory instead of a display. */
+struct mem_renderer {
+	struct renderer r;
+
+	/** r.width*r.height gray pixels. */
+	uint8_t *pix;
+
+	/** Scratch space for one cell's glyph. */
+	uint8_t *mask;
+
+	struct glyph_cache glyphs;
+
+	uint32_t marker;
+};
+
+/* Returns the phase to cache a cell under; see render_phase. Shades mix
+ * their colors, which can take dithering even if neither color does. */
+static uint32_t
+phase(struct renderer *r, int row, int col, rune c, uint32_t fg, uint32_t bg)
+{
+	if (COLOR_PAT(fg) == 0 && COLOR_PAT(bg) == 0 && !boxdraw_has(c))
+		return 0;
+	return render_phase(r, row, col);
+}
+
+static int
+mem_raster(void *ctx, rune c, uint32_t fg, uint32_t bg, uint8_t *out)
+{
+	struct mem_renderer *m = ctx;
+	int cw = m->r.cw, ch = m->r.ch;
+	int px, py;
+
+	render_unphase(&fg, &bg, &px, &py);
+
+	if (boxdraw_raster(c, m->mask, cw, ch)) {
+		for (int y = 0; y < ch; ++y) {
+			for (int x = 0; x < cw; ++x) {
+				uint8_t a = m->mask[y*cw+x];
+				uint32_t color = a == 0 ? bg : a == 0xFF ? fg : term_mix(fg, bg, a);
+				out[y*cw+x] = color_at(color, px+x, py+y);
+			}
+		}
+		return 0;
+	}
+
+	font_raster(c, m->mask, cw, ch);
+	for (int y = 0; y < ch; ++y)
+		for (int x = 0; x < cw; ++x)
+			out[y*cw+x] = color_at(m->mask[y*cw+x] ? fg : bg, px+x, py+y);
+
+	return 0;
+}
+
+static void
+mem_draw_span(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+	uint8_t *dst = &m->pix[(r->oy + row*r->ch)*r->width + r->ox + col*r->cw];
+
+	for (int i = 0; i < n; ++i, dst += r->cw) {
+		uint32_t p = phase(r, row, col+i, text[i], fg, bg);
+
+		// Only look it up first, so nothing changes if this is one of
+		// several threads drawing after mem_warm.
+		const uint8_t *glyph = glyph_find(&m->glyphs, text[i], fg|p, bg|p);
+		if (!glyph)
+			glyph = glyph_get(&m->glyphs, text[i], fg|p, bg|p);
+		if (glyph)
+			glyph_blit(&m->glyphs, glyph, dst, r->width);
+	}
+}
+
+static int
+mem_warm(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+	unsigned flushes = m->glyphs.flushes;
+
+	for (int i = 0; i < n; ++i) {
+		uint32_t p = phase(r, row, col+i, text[i], fg, bg);
+		glyph_get(&m->glyphs, text[i], fg|p, bg|p);
+	}
+
+	// Anything warmed before this may be gone.
+	return m->glyphs.flushes == flushes ? 0 : -1;
+}
+
+static void
+mem_draw_tile(struct renderer *r, int row, int col, const uint8_t *tile, int invert)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+	int x0 = r->ox + col*r->cw;
+	int y0 = r->oy + row*r->ch;
+
+	for (int y = 0; y < r->ch; ++y) {
+		uint8_t *dst = &m->pix[(y0+y)*r->width + x0];
+		const uint8_t *src = &tile[y*r->cw];
+
+		if (!invert) {
+			memcpy(dst, src, r->cw);
+			continue;
+		}
+
+		for (int x = 0; x < r->cw; ++x)
+			dst[x] = 0xFF - src[x];
+	}
+}
+
+static void
+mem_fill_rect(struct renderer *r, int x, int y, int w, int h, uint32_t color)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+
+	for (int j = y; j < y+h; ++j) {
+		uint8_t *dst = &m->pix[j*r->width];
+
+		if (COLOR_PAT(color) == 0) {
+			memset(dst+x, COLOR_GRAY(color), w);
+			continue;
+		}
+
+		for (int i = x; i < x+w; ++i)
+			dst[i] = color_at(color, i, j);
+	}
+}
+
+static void
+mem_move_rect(struct renderer *r, int x, int y, int w, int h, int dx, int dy)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+
+	// Go against the direction of movement so rows don't get clobbered
+	// before they are copied.
+	if (dy > 0) {
+		for (int j = y+h-1; j >= y; --j)
+			memmove(&m->pix[(j+dy)*r->width + x+dx], &m->pix[j*r->width + x], w);
+	} else {
+		for (int j = y; j < y+h; ++j)
+			memmove(&m->pix[(j+dy)*r->width + x+dx], &m->pix[j*r->width + x], w);
+	}
+}
+
+static uint32_t
+mem_refresh(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	// Nothing to show it on.
+	return ++((struct mem_renderer *)r)->marker;
+}
+
+static void
+mem_wait(struct renderer *r, uint32_t marker)
+{
+	// Refreshes complete immediately.
+}
+
+static void
+mem_free(struct renderer *r)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+
+	render_free(r);
+	glyph_free(&m->glyphs);
+	free(m->pix);
+	free(m->mask);
+	free(m);
+}
+
+struct renderer *
+render_mem_new(int rows, int cols, int cw, int ch)
+{
+	struct mem_renderer *m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->r.cw = cw;
+	m->r.ch = ch;
+	m->r.width = cols*cw;
+	m->r.height = rows*ch;
+
+	m->r.draw_span = mem_draw_span;
+	m->r.warm = mem_warm;
+	m->r.draw_tile = mem_draw_tile;
+	m->r.fill_rect = mem_fill_rect;
+	m->r.move_rect = mem_move_rect;
+	m->r.refresh = mem_refresh;
+	m->r.wait = mem_wait;
+	m->r.free = mem_free;
+	m->r.fd = -1;
+
+	region_init(&m->r.damage, REGION_DEFAULT_COUNT, REGION_DEFAULT_SLACK, 1);
+
+	m->glyphs.raster = mem_raster;
+	m->glyphs.ctx = m;
+
+	m->pix = malloc(m->r.width*m->r.height);
+	m->mask = malloc(cw*ch);
+	if (!m->pix || !m->mask || glyph_init(&m->glyphs, cw, ch, 1) == -1) {
+		mem_free(&m->r);
+		return NULL;
+	}
+
+	// Start off with a blank, white screen like fbink_cls.
+	memset(m->pix, 0xFF, m->r.width*m->r.height);
+
+	return &m->r;
+}
+
+uint8_t *
+render_mem_pixels(struct renderer *r)
+{
+	return ((struct mem_renderer *)r)->pix;
+}
+
+int
+render_mem_dump(struct renderer *r, FILE *f)
+{
+	struct mem_renderer *m = (struct mem_renderer *)r;
+
+	fprintf(f, "P5\n%d %d\n255\n", r->width, r->height);
+	if (fwrite(m->pix, r->width, r->height, f) != r->height || fflush(f) == EOF)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,300 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "render_sim.h"
+
+/* A refresh that was submitted and has not completed yet. */
+struct update {
+	struct region reg;
+	uint32_t marker;
+	int64_t start, end;
+};
+
+/* A renderer that only keeps time. */
+struct sim_renderer {
+	struct renderer r;
+	struct sim_panel panel;
+	struct sim_stats stats;
+
+	int64_t now, busy;
+
+	struct update *live;
+	int nlive, maxlive;
+
+	uint32_t marker;
+
+	/** Completed markers are written to done[1]; r.fd is done[0]. */
+	int done[2];
+};
+
+static inline int
+overlaps(struct region a, struct region b)
+{
+	return a.x < b.x+b.w && b.x < a.x+a.w && a.y < b.y+b.h && b.y < a.y+a.h;
+}
+
+/** Returns the earliest time at or after t that an update of reg can start,
+ * and counts what it had to wait for. */
+static int64_t
+schedule(struct sim_renderer *s, struct region reg, int64_t t)
+{
+	int collided = 0, starved = 0;
+
+	// Waiting for one thing can run into another, so keep going until
+	// nothing is in the way.
+	for (int moved = 1; moved; ) {
+		moved = 0;
+
+		for (int i = 0; i < s->nlive; ++i) {
+			struct update *u = &s->live[i];
+			if (u->end > t && overlaps(u->reg, reg)) {
+				t = u->end;
+				collided = moved = 1;
+			}
+		}
+
+		int running = 0;
+		int64_t first = 0;
+		for (int i = 0; i < s->nlive; ++i) {
+			struct update *u = &s->live[i];
+			if (u->start <= t && t < u->end) {
+				if (!running++ || u->end < first)
+					first = u->end;
+			}
+		}
+		if (running >= s->panel.luts) {
+			t = first;
+			starved = moved = 1;
+		}
+	}
+
+	s->stats.collisions += collided;
+	s->stats.lut_waits += starved;
+	return t;
+}
+
+static int
+cmp_start(const void *a, const void *b)
+{
+	int64_t x = ((const struct update *)a)->start, y = ((const struct update *)b)->start;
+	return x < y ? -1 : x > y;
+}
+
+/** Adds up how much of the time between the clock and now at least one update
+ * was running. */
+static int64_t
+busy_until(struct sim_renderer *s, int64_t now)
+{
+	if (!s->nlive)
+		return 0;
+
+	struct update sorted[s->nlive];
+	for (int i = 0; i < s->nlive; ++i)
+		sorted[i] = s->live[i];
+	qsort(sorted, s->nlive, sizeof(*sorted), cmp_start);
+
+	int64_t busy = 0, covered = s->now;
+	for (int i = 0; i < s->nlive; ++i) {
+		int64_t a = sorted[i].start > covered ? sorted[i].start : covered;
+		int64_t b = sorted[i].end < now ? sorted[i].end : now;
+		if (b > a) {
+			busy += b - a;
+			covered = b;
+		}
+	}
+	return busy;
+}
+
+static void
+sim_draw_span(struct renderer *r, int row, int col, const rune *text, int n, uint32_t fg, uint32_t bg)
+{
+}
+
+static void
+sim_draw_tile(struct renderer *r, int row, int col, const uint8_t *tile, int invert)
+{
+}
+
+static void
+sim_fill_rect(struct renderer *r, int x, int y, int w, int h, uint32_t color)
+{
+}
+
+static uint32_t
+sim_refresh(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+
+	if (!w || !h) {
+		x = y = 0;
+		w = r->width;
+		h = r->height;
+	}
+
+	int kind = flags & REFRESH_FLASH ? 3 : flags & REFRESH_QUALITY ? 2 : flags & REFRESH_FAST ? 0 : 1;
+	int durations[] = { s->panel.fast, s->panel.text, s->panel.quality, s->panel.flash };
+
+	if (s->nlive == s->maxlive) {
+		int max = s->maxlive ? s->maxlive*2 : 16;
+		struct update *live = realloc(s->live, max*sizeof(*live));
+		if (!live)
+			return 0;
+		s->live = live;
+		s->maxlive = max;
+	}
+
+	struct update *u = &s->live[s->nlive];
+	u->reg = (struct region){ .x = x, .y = y, .w = w, .h = h };
+	u->start = schedule(s, u->reg, s->now);
+	u->end = u->start + durations[kind];
+	u->marker = ++s->marker;
+	++s->nlive;
+	++r->inflight;
+
+	++s->stats.updates[kind];
+	s->stats.waited += u->start - s->now;
+	s->stats.updating += u->end - u->start;
+
+	return u->marker;
+}
+
+static void
+sim_wait(struct renderer *r, uint32_t marker)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+	int64_t end = -1;
+
+	for (int i = 0; i < s->nlive; ++i)
+		if ((!marker || s->live[i].marker == marker) && s->live[i].end > end)
+			end = s->live[i].end;
+
+	if (end != -1)
+		render_sim_advance(r, end);
+}
+
+static void
+sim_free(struct renderer *r)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+
+	if (s->done[0] != -1) {
+		close(s->done[0]);
+		close(s->done[1]);
+	}
+	render_free(r);
+	free(s->live);
+	free(s);
+}
+
+void
+sim_panel_init(struct sim_panel *panel)
+{
+	// DU, GL16 and GC16, and GC16 with the flash.
+	*panel = (struct sim_panel){
+		.fast = 260,
+		.text = 480,
+		.quality = 650,
+		.flash = 760,
+		.luts = 16,
+	};
+}
+
+struct renderer *
+render_sim_new(int rows, int cols, int cw, int ch, const struct sim_panel *panel)
+{
+	struct sim_renderer *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->r.cw = cw;
+	s->r.ch = ch;
+	s->r.width = cols*cw;
+	s->r.height = rows*ch;
+
+	s->r.draw_span = sim_draw_span;
+	s->r.draw_tile = sim_draw_tile;
+	s->r.fill_rect = sim_fill_rect;
+	s->r.refresh = sim_refresh;
+	s->r.wait = sim_wait;
+	s->r.free = sim_free;
+
+	// Same as the EPDC wants.
+	region_init(&s->r.damage, REGION_DEFAULT_COUNT, REGION_DEFAULT_SLACK, 8);
+
+	s->panel = *panel;
+	if (s->panel.luts < 1)
+		s->panel.luts = 1;
+
+	if (pipe(s->done) == -1) {
+		s->done[0] = -1;
+		sim_free(&s->r);
+		return NULL;
+	}
+	fcntl(s->done[0], F_SETFL, O_NONBLOCK);
+	fcntl(s->done[1], F_SETFL, O_NONBLOCK);
+	s->r.fd = s->done[0];
+
+	return &s->r;
+}
+
+void
+render_sim_advance(struct renderer *r, int64_t now)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+
+	if (now <= s->now)
+		return;
+
+	s->busy += busy_until(s, now);
+	s->now = now;
+
+	for (int i = 0; i < s->nlive; ) {
+		if (s->live[i].end > now) {
+			++i;
+			continue;
+		}
+
+		write(s->done[1], &s->live[i].marker, sizeof(s->live[i].marker));
+		s->live[i] = s->live[--s->nlive];
+	}
+}
+
+int64_t
+render_sim_next(struct renderer *r)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+	int64_t next = -1;
+
+	for (int i = 0; i < s->nlive; ++i)
+		if (next == -1 || s->live[i].end < next)
+			next = s->live[i].end;
+
+	return next;
+}
+
+int64_t
+render_sim_end(struct renderer *r, uint32_t marker)
+{
+	struct sim_renderer *s = (struct sim_renderer *)r;
+
+	for (int i = 0; i < s->nlive; ++i)
+		if (s->live[i].marker == marker)
+			return s->live[i].end;
+
+	return -1;
+}
+
+int64_t
+render_sim_busy(struct renderer *r)
+{
+	return ((struct sim_renderer *)r)->busy;
+}
+
+const struct sim_stats *
+render_sim_stats(struct renderer *r)
+{
+	return &((struct sim_renderer *)r)->stats;
+}
@@ -0,0 +1,68 @@
+#ifndef RENDER_SIM_H
+#define RENDER_SIM_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+/** How the simulated panel behaves. Times are in milliseconds. */
+struct sim_panel {
+	/** How long an update takes with each waveform. Updates without a
+	 * waveform hint take as long as text. */
+	int fast, text, quality, flash;
+
+	/** The most updates that can be running at once, which is how many
+	 * waveform lookup tables the controller has. */
+	int luts;
+};
+
+/** What the simulated panel has done so far. */
+struct sim_stats {
+	/** Updates by waveform, in the order of the fields of sim_panel. */
+	long updates[4];
+
+	/** Updates that had to wait for an overlapping one to finish. */
+	long collisions;
+
+	/** Updates that had to wait for a lookup table to free up. */
+	long lut_waits;
+
+	/** Time spent waiting to start and running, summed over all
+	 * updates. */
+	int64_t waited, updating;
+};
+
+/** Fills in the timings of a Carta panel on an i.MX EPDC. */
+void sim_panel_init(struct sim_panel *panel);
+
+/** Creates a renderer that draws nothing, but works out when its refreshes
+ * would have run and completed on the panel described by panel.
+ *
+ * Refreshes start as soon as nothing they overlap is running and a lookup
+ * table is free, and complete the time their waveform takes later. Time only
+ * moves when render_sim_advance is called; r->fd becomes readable once any
+ * refresh has completed by then, like on a real device.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+struct renderer *render_sim_new(int rows, int cols, int cw, int ch, const struct sim_panel *panel);
+
+/** Moves the clock of a simulated renderer forward to now, and completes
+ * every refresh that is done by then. */
+void render_sim_advance(struct renderer *r, int64_t now);
+
+/** Returns when the next refresh completes, or -1 if none are running. */
+int64_t render_sim_next(struct renderer *r);
+
+/** Returns when the refresh with marker completes, or -1 if there is no such
+ * refresh. Only refreshes that have not completed yet can be asked about. */
+int64_t render_sim_end(struct renderer *r, uint32_t marker);
+
+/** Returns how long the panel was busy with at least one refresh, up to the
+ * clock. */
+int64_t render_sim_busy(struct renderer *r);
+
+/** Returns what the panel has done so far. */
+const struct sim_stats *render_sim_stats(struct renderer *r);
+
+#endif /* RENDER_SIM_H */
@@ -0,0 +1,58 @@
+#include "render.h"
+#include "sched.h"
+
+void
+sched_init(struct sched *s)
+{
+	// About a word's worth of typing, or a line of a prompt being
+	// redrawn.
+	s->fast_cells = 16;
+	s->fast_rows = 1;
+	s->full_percent = 50;
+}
+
+/** Returns non-zero if any cell between row0...row1 and col0...col1 shows part
+ * of an image. */
+static int
+has_image(const struct term *term, int row0, int col0, int row1, int col1)
+{
+	for (int y = row0; y <= row1; ++y)
+		for (int x = col0; x <= col1; ++x)
+			if (term->cells[y*term->cols + x].img)
+				return 1;
+	return 0;
+}
+
+int
+sched_classify(const struct sched *s, const struct term *term, const struct region *reg, int cw, int ch, int ox, int oy)
+{
+	// Work in cells, clamped to the grid; regions can stick out of it
+	// because of alignment.
+	int col0 = (reg->x - ox) / cw, col1 = (reg->x + reg->w - ox - 1) / cw;
+	int row0 = (reg->y - oy) / ch, row1 = (reg->y + reg->h - oy - 1) / ch;
+	if (col0 < 0) col0 = 0;
+	if (row0 < 0) row0 = 0;
+	if (col1 > term->cols-1) col1 = term->cols-1;
+	if (row1 > term->rows-1) row1 = term->rows-1;
+	if (col0 > col1 || row0 > row1)
+		return REFRESH_TEXT;
+
+	long cells = (long)(col1-col0+1) * (row1-row0+1);
+
+	// Images need every gray level, and so does a big repaint, since
+	// whatever was there before will be ghosting through otherwise.
+	if (cells*100 >= (long)s->full_percent*term->rows*term->cols
+	    || has_image(term, row0, col0, row1, col1))
+		return REFRESH_QUALITY;
+
+	// Scrolling moves everything, so the fast waveform's ghosting would
+	// be all over the place.
+	if (term->scrolled)
+		return REFRESH_TEXT;
+
+	if (cells <= s->fast_cells
+	    && row0 - s->fast_rows <= term->row && term->row <= row1 + s->fast_rows)
+		return REFRESH_FAST;
+
+	return REFRESH_TEXT;
+}
@@ -0,0 +1,32 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "region.h"
+#include "term.h"
+
+/** Decides which waveform each refresh of a frame should use.
+ *
+ * Small changes close to the cursor are most likely typing, which should show
+ * up as fast as the panel can manage. Scrolling text gets a waveform that
+ * looks reasonable without flashing, and big repaints and images get the slow
+ * one that shows every gray level properly.
+ */
+struct sched {
+	/** Regions of up to this many cells, within fast_rows rows of the
+	 * cursor, use the fast waveform. */
+	int fast_cells;
+	int fast_rows;
+
+	/** Regions that cover at least this percentage of the grid use the
+	 * quality waveform. */
+	int full_percent;
+};
+
+/** Fills in the default thresholds. */
+void sched_init(struct sched *s);
+
+/** Returns the REFRESH_* waveform flag for a region that was drawn from term
+ * with cells of cw*ch pixels, the top left of which is at ox, oy. */
+int sched_classify(const struct sched *s, const struct term *term, const struct region *reg, int cw, int ch, int ox, int oy);
+
+#endif /* SCHED_H */
@@ -0,0 +1,402 @@
+/* Replays a recorded session against a simulated panel, to see how changes to
+ * how and when the screen is refreshed would play out on the device.
+ *
+ * Sessions are recorded with script(1) from util-linux, which keeps the time
+ * of every read from the keyboard and the terminal:
+ *
+ *     script -m advanced -B session.log -T session.tm
+ *
+ * Time in the replay is simulated, and follows the same rules as the main loop
+ * of inkterm: output is drawn once the pacer's wait runs out or the frame
+ * deadline passes, nothing is drawn while too many refreshes are in flight,
+ * and ghosting is cleaned up after a while of being idle. The flags that tune
+ * those are the same as inkterm's.
+ *
+ * The time from a key press until the output that followed it has finished
+ * refreshing is the key to visible latency. Drawing itself takes no time,
+ * unless -c says otherwise. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pacer.h"
+#include "render_sim.h"
+#include "term.h"
+#include "x.h"
+
+/* One line of a script(1) timing file. */
+struct record {
+	/** 'I' for input, 'O' for output. */
+	char type;
+	int64_t time;
+	size_t size;
+};
+
+static struct record *records;
+static int nrecords;
+
+static struct term term;
+static struct renderer *renderer;
+static struct pacer pacer;
+static struct sched sched;
+static struct ghost ghost;
+
+static int frame_deadline = 150, max_inflight = 4, draw_cost = 0;
+
+/* The current time, in milliseconds since the start of the session. */
+static int64_t now;
+
+/* The same as in main.c. */
+static int writing;
+static int64_t undrawn_since, last_active;
+
+/* When every key was pressed. Keys before echoed have seen output since, and
+ * keys before shown have been drawn. */
+static int64_t *keys;
+static int nkeys, echoed, shown;
+
+/* When each key showed up, in the same order. */
+static int64_t *latency;
+static int nlatency;
+
+/* When the last refresh of the frame being drawn completes. */
+static int64_t frame_end;
+static int frames;
+
+static uint32_t (*sim_refresh)(struct renderer *r, int x, int y, int w, int h, int flags);
+
+static uint32_t
+frame_refresh(struct renderer *r, int x, int y, int w, int h, int flags)
+{
+	uint32_t marker = sim_refresh(r, x, y, w, h, flags);
+	int64_t end = render_sim_end(r, marker);
+	if (end > frame_end)
+		frame_end = end;
+	return marker;
+}
+
+/** Reads a script(1) timing file, and the size of the screen if it was
+ * recorded. */
+static void
+read_timing(const char *path, int *rows, int *cols)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		die("%s: %s\n", path, strerror(errno));
+
+	double t = 0;
+	int max = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		char type, name[32];
+		double delay;
+		size_t size;
+
+		if (sscanf(line, "%c %lf", &type, &delay) != 2)
+			die("%s: not a timing file in advanced format\n", path);
+		t += delay;
+
+		// Header lines say something about the session.
+		if (type == 'H') {
+			int n;
+			if (sscanf(line, "H %*f %31s %d", name, &n) == 2) {
+				if (!strcmp(name, "LINES"))
+					*rows = n;
+				else if (!strcmp(name, "COLUMNS"))
+					*cols = n;
+			}
+			continue;
+		}
+
+		if ((type != 'I' && type != 'O') || sscanf(line, "%*c %*f %zu", &size) != 1)
+			continue;
+
+		if (nrecords == max) {
+			max = max ? max*2 : 1024;
+			records = realloc(records, max*sizeof(*records));
+			if (!records)
+				die("out of memory\n");
+		}
+		records[nrecords++] = (struct record){ .type = type, .time = t*1000, .size = size };
+	}
+
+	fclose(f);
+}
+
+static FILE *
+open_log(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		die("%s: %s\n", path, strerror(errno));
+
+	// script writes a line about itself first, which isn't timed.
+	char line[512];
+	if (!fgets(line, sizeof(line), f) || strncmp(line, "Script started", 14))
+		rewind(f);
+
+	return f;
+}
+
+static void *
+grow(void *ptr, int n)
+{
+	// Sizes double, so only powers of two need more room.
+	if (n & (n-1))
+		return ptr;
+
+	ptr = realloc(ptr, (n ? 2*n : 1)*sizeof(int64_t));
+	if (!ptr)
+		die("out of memory\n");
+	return ptr;
+}
+
+static void
+frame(void)
+{
+	writing = 0;
+
+	now += draw_cost;
+	render_sim_advance(renderer, now);
+
+	frame_end = -1;
+	render_draw(renderer, &term);
+	pacer_drawn(&pacer, (int64_t)draw_cost*1000);
+	++frames;
+
+	// Keys that had output after them are visible once it is.
+	if (frame_end != -1) {
+		for (; shown < echoed; ++shown) {
+			latency = grow(latency, nlatency);
+			latency[nlatency++] = frame_end - keys[shown];
+		}
+	}
+}
+
+static void
+output(FILE *log, size_t size)
+{
+	unsigned char buf[4096];
+	static size_t len;
+
+	while (size) {
+		size_t n = sizeof(buf)-len < size ? sizeof(buf)-len : size;
+		if (fread(buf+len, 1, n, log) != n)
+			die("log is shorter than its timing file\n");
+		size -= n;
+
+		// Incomplete sequences are kept for the next time.
+		len += n;
+		size_t written = term_write(&term, buf, len);
+		len -= written;
+		memmove(buf, buf+written, len);
+	}
+
+	if (!writing)
+		undrawn_since = now;
+	writing = 1;
+	last_active = now;
+	echoed = nkeys;
+}
+
+static void
+replay(FILE *log, FILE *in)
+{
+	int next = 0;
+
+	for (;;) {
+		// Work out how long inkterm would poll for, like the main
+		// loop does.
+		int busy = renderer->inflight >= max_inflight;
+		int64_t timeout = -1;
+		if (writing && !busy) {
+			int64_t left = frame_deadline - (now - undrawn_since);
+			timeout = pacer_interval(&pacer, now);
+			if (left < timeout)
+				timeout = left < 0 ? 0 : left;
+		} else if (!writing && !busy && ghost_pending(&ghost)) {
+			int64_t left = ghost.idle - (now - last_active);
+			timeout = left < 0 ? 0 : left;
+		}
+
+		// Whatever happens first is what poll would have returned
+		// for.
+		int64_t event = render_sim_next(renderer);
+		if (next < nrecords && (event == -1 || records[next].time < event))
+			event = records[next].time;
+		if (event != -1 && event < now)
+			event = now;
+
+		if (timeout != -1 && (event == -1 || now+timeout < event)) {
+			now += timeout;
+			render_sim_advance(renderer, now);
+
+			if (writing && !busy)
+				frame();
+			else
+				render_clean(renderer);
+			continue;
+		}
+
+		if (event == -1)
+			break;
+
+		now = event;
+		render_sim_advance(renderer, now);
+
+		if (writing && !busy && now - undrawn_since >= frame_deadline)
+			frame();
+
+		render_reap(renderer);
+
+		for (; next < nrecords && records[next].time <= now; ++next) {
+			if (records[next].type == 'O') {
+				output(log, records[next].size);
+				pacer_data(&pacer, now, records[next].size);
+				continue;
+			}
+
+			// The keys themselves don't matter, only when they
+			// were pressed.
+			if (fseek(in, records[next].size, SEEK_CUR) == -1)
+				die("fseek: %s\n", strerror(errno));
+
+			last_active = now;
+			pacer_key(&pacer, now);
+			keys = grow(keys, nkeys);
+			keys[nkeys++] = now;
+		}
+	}
+}
+
+static int
+cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(void)
+{
+	const struct sim_stats *st = render_sim_stats(renderer);
+	long updates = st->updates[0] + st->updates[1] + st->updates[2] + st->updates[3];
+
+	printf("session   %.1f s, %d frames, %d keys (%d echoed)\n", now/1e3, frames, nkeys, nlatency);
+
+	if (nlatency) {
+		qsort(latency, nlatency, sizeof(*latency), cmp_i64);
+		printf("latency   p50 %ld  p90 %ld  p99 %ld  max %ld ms from key to visible\n",
+			(long)latency[(nlatency-1)*50/100], (long)latency[(nlatency-1)*90/100],
+			(long)latency[(nlatency-1)*99/100], (long)latency[nlatency-1]);
+	}
+
+	printf("updates   %ld: %ld fast, %ld text, %ld quality, %ld flash\n", updates,
+		st->updates[0], st->updates[1], st->updates[2], st->updates[3]);
+	printf("waits     %ld collisions, %ld for a lookup table, %.1f ms on average\n",
+		st->collisions, st->lut_waits, updates ? (double)st->waited/updates : 0.0);
+	printf("busy      %.1f s (%.0f%% of the session), %.1f s of updates\n",
+		render_sim_busy(renderer)/1e3, now ? 100.0*render_sim_busy(renderer)/now : 0.0,
+		st->updating/1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rows = 0, cols = 0;
+	int regions = REGION_DEFAULT_COUNT, slack = REGION_DEFAULT_SLACK;
+	int ghost_threshold = 32, ghost_idle = 2000;
+	int pace_min = 1, pace_max = 40;
+
+	struct sim_panel panel;
+	sim_panel_init(&panel);
+	sched_init(&sched);
+
+	const char *usage = "usage: %s [-c draw_ms] [-f deadline] [-i inflight] [-l luts] [-p min:max]\n"
+		"\t[-q threshold:idle_ms] [-r regions] [-s slack] [-S rowsxcols]\n"
+		"\t[-t fast:text:quality:flash] [-w fast_cells:fast_rows:full_percent]\n"
+		"\ttiming log [input_log]\n";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:i:l:p:q:r:s:S:t:w:")) != -1) {
+		switch (opt) {
+		case 'c': draw_cost = atoi(optarg); break;
+		case 'f': frame_deadline = atoi(optarg); break;
+		case 'i': max_inflight = atoi(optarg); break;
+		case 'l': panel.luts = atoi(optarg); break;
+		case 'p':
+			if (sscanf(optarg, "%d:%d", &pace_min, &pace_max) != 2 || pace_min < 0)
+				die("-p wants min:max\n");
+			break;
+		case 'q':
+			if (sscanf(optarg, "%d:%d", &ghost_threshold, &ghost_idle) != 2)
+				die("-q wants threshold:idle_ms\n");
+			break;
+		case 'r': regions = atoi(optarg); break;
+		case 's': slack = atoi(optarg); break;
+		case 'S':
+			if (sscanf(optarg, "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1)
+				die("-S wants rowsxcols\n");
+			break;
+		case 't':
+			if (sscanf(optarg, "%d:%d:%d:%d", &panel.fast, &panel.text, &panel.quality, &panel.flash) != 4)
+				die("-t wants fast:text:quality:flash\n");
+			break;
+		case 'w':
+			if (sscanf(optarg, "%d:%d:%d", &sched.fast_cells, &sched.fast_rows, &sched.full_percent) != 3)
+				die("-w wants fast_cells:fast_rows:full_percent\n");
+			break;
+		default: die(usage, argv[0]);
+		}
+	}
+
+	if (argc-optind < 2 || argc-optind > 3)
+		die(usage, argv[0]);
+	if (regions < 1 || regions > REGION_MAX)
+		die("regions must be between 1 and %d\n", REGION_MAX);
+
+	// A size given on the command line wins over the recorded one.
+	int rec_rows = 24, rec_cols = 80;
+	read_timing(argv[optind], &rec_rows, &rec_cols);
+	if (!rows) {
+		rows = rec_rows;
+		cols = rec_cols;
+	}
+
+	FILE *log = open_log(argv[optind+1]);
+	FILE *in = argc-optind == 3 ? open_log(argv[optind+2]) : log;
+
+	int slave;
+	if (term_init(&term, rows, cols, &slave) == -1)
+		die("term_init: %s\n", strerror(errno));
+
+	if ((renderer = render_sim_new(rows, cols, term.cw, term.ch, &panel)) == NULL)
+		die("failed to init renderer: %s\n", strerror(errno));
+	region_init(&renderer->damage, regions, slack, renderer->damage.align);
+	renderer->sched = &sched;
+	if (ghost_init(&ghost, renderer->width, renderer->height, ghost_threshold, ghost_idle) == -1)
+		die("failed to init ghost tracking: %s\n", strerror(errno));
+	renderer->ghost = &ghost;
+
+	sim_refresh = renderer->refresh;
+	renderer->refresh = frame_refresh;
+
+	pacer_init(&pacer, pace_min, pace_max);
+	replay(log, in);
+	report();
+
+	renderer->free(renderer);
+	ghost_free(&ghost);
+	term_free(&term);
+	close(slave);
+	fclose(log);
+	if (in != log)
+		fclose(in);
+	free(records);
+	free(keys);
+	free(latency);
+}
@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
@@ -34,7 +35,10 @@
 enum {
 	ESC_NONE,
 	ESC_START,
-	ESC_CSI
+	ESC_CSI,
+	ESC_DCS,	/* Parameters of a DCS string */
+	ESC_DCSIGNORE,	/* Payload of a DCS string we don't support */
+	ESC_SIXEL	/* Payload of a sixel image */
 };
 
 // This table is for the \033[X;Ym type sequences.
@@ -56,28 +60,103 @@ static int attr_table[] = {
 };
 
 // NOTE: Because inkterm targets e-readers, this is in light mode!
-// TODO: Colors. fbink can do colors and will dither them.
+// These are the 16 gray levels of a Carta panel, and the base of the palette
+// below.
 const uint32_t colors[] = {
-	0x00FFFFFF,
-	0x00EEEEEE,
-	0x00DDDDDD,
-	0x00CCCCCC,
-	0x00BBBBBB,
-	0x00AAAAAA,
-	0x00999999,
-	0x00888888,
-	0x00777777,
-	0x00666666,
-	0x00555555,
-	0x00444444,
-	0x00333333,
-	0x00222222,
-	0x00111111,
-	0x00000000,
+	0xFF,
+	0xEE,
+	0xDD,
+	0xCC,
+	0xBB,
+	0xAA,
+	0x99,
+	0x88,
+	0x77,
+	0x66,
+	0x55,
+	0x44,
+	0x33,
+	0x22,
+	0x11,
+	0x00,
 };
 
-static uint32_t default_bg = colors[ 0],
-		default_fg = colors[15];
+/* Maps a luminance value to a packed color at the panel's gray levels.
+ * Built by term_set_graylevels. */
+static uint32_t graymap[256];
+
+/* Like graymap, but always dithered. Used for images. */
+static uint32_t imgmap[256];
+
+/* The 256 color palette, already run through graymap.
+ * Built by term_set_graylevels. */
+static uint32_t palette[256];
+
+static int graylevels = 0;
+
+static uint32_t default_bg, default_fg;
+
+/** Computes the luminance of an RGB color. */
+static inline int
+luma(int r, int g, int b)
+{
+	// Rec. 601 weights.
+	return (r*77 + g*150 + b*29) >> 8;
+}
+
+void
+term_set_graylevels(int levels, int dither)
+{
+	assert(levels >= 2 && levels <= 256);
+
+	graylevels = levels;
+
+	for (int l = 0; l < 256; ++l) {
+		// Position of l in between two levels, in 1/16ths.
+		int pos = l * (levels-1) * 16 / 255;
+		int lo = pos / 16, frac = pos % 16;
+
+		if (!dither) {
+			// Round to the nearest level.
+			lo = (pos + 8) / 16;
+			frac = 0;
+		}
+
+		int hi = lo < levels-1 ? lo+1 : lo;
+		graymap[l] = (lo * 255 / (levels-1))
+			| (hi * 255 / (levels-1)) << 8
+			| frac << 16;
+
+		lo = pos / 16;
+		hi = lo < levels-1 ? lo+1 : lo;
+		imgmap[l] = (lo * 255 / (levels-1))
+			| (hi * 255 / (levels-1)) << 8
+			| (pos % 16) << 16;
+	}
+
+	// The first 16 colors are the gray ramp.
+	for (int i = 0; i < 16; ++i)
+		palette[i] = graymap[COLOR_GRAY(colors[i])];
+
+	// 16-231 are a 6x6x6 color cube.
+	// Like colors[], these are flipped so dark colors come out light.
+	static const int cube[] = { 0x00, 0x5F, 0x87, 0xAF, 0xD7, 0xFF };
+	for (int i = 0; i < 216; ++i)
+		palette[16+i] = graymap[255-luma(cube[i/36], cube[(i/6)%6], cube[i%6])];
+
+	// 232-255 are a gray ramp that skips black and white.
+	for (int i = 0; i < 24; ++i)
+		palette[232+i] = graymap[255-luma(8+i*10, 8+i*10, 8+i*10)];
+
+	default_bg = palette[ 0];
+	default_fg = palette[15];
+}
+
+uint32_t
+term_mix(uint32_t fg, uint32_t bg, uint8_t a)
+{
+	return graymap[(COLOR_GRAY(fg)*a + COLOR_GRAY(bg)*(255-a)) / 255];
+}
 
 /** Marks a cell at row/col as damaged. */
 static inline void
@@ -97,6 +176,15 @@ damage(struct term *term, int row, int col)
 	term->damage[byt] |= (term_damage_t)(1)<<(bit);
 }
 
+/** Marks a cell at row/col as damaged, even if it looks the same as before.
+ * This is for image tiles, whose pixels can change under the cell. */
+static inline void
+damage_force(struct term *term, int row, int col)
+{
+	int idx = (row*term->cols)+col;
+	term->damage[idx / DAMAGE_WIDTH] |= (term_damage_t)(1)<<(idx % DAMAGE_WIDTH);
+}
+
 /** Mark a single line as damaged. */
 static inline void
 damageline(struct term *term, int row)
@@ -159,6 +247,7 @@ dellines(struct term *term, int row, int count)
 	memmove(dst, src, sizeof(*term->cells)*(term->margin_bottom-row-count+1)*term->cols);
 	for (int i = term->margin_bottom-count+1; i <= term->margin_bottom; ++i)
 		init_row(term, i);
+	term->scrolled += count;
 
 	// TODO: This is lazy
 	damagescr(term);
@@ -192,6 +281,7 @@ newline(struct term *term, int firstcol)
 	// Clear the new line.
 	memset(&term->cells[term->margin_bottom*term->cols], 0, sizeof(*term->cells)*term->cols);
 	init_row(term, term->rows-1);
+	++term->scrolled;
 
 	// Damage everything in between the margins.
 	// If the margins are 0 and term->rows-1, then damage the screen.
@@ -211,7 +301,7 @@ control(struct term *term, rune c)
 	switch (c) {
 	case '\a': // BEL; Bell
 		// Do something, if we are told to
-		if (term->on_bell) term->on_bell();
+		if (term->on_bell) term->on_bell(term);
 		break;
 	case '\t': // TAB
 		// Add 8 chars and round down to nearest 8.
@@ -249,6 +339,9 @@ esc(struct term *term, rune c)
 	case '8': // DECRC; DEC Restore Cursor
 		term_move(term, term->oldrow, term->oldcol);
 		break;
+	case '\\': // ST; String Terminator
+		// Ends a DCS string, which has already been handled.
+		break;
 	case '(':
 		/* This asks the terminal to choose a different character set.
 		 * Since that's kinda hard for us to do, we're just gonna
@@ -264,6 +357,313 @@ esc(struct term *term, rune c)
 	}
 }
 
+/* Sixel images.
+ *
+ * The decoder does not keep the image around; every sixel is written straight
+ * into the tiles of the cells it lands on, and those cells are damaged.
+ * Memory use is bounded by the tile pool, which has one tile per cell.
+ */
+
+/* The VT340 default color registers, as RGB percentages. */
+static const uint8_t sixel_defaults[16][3] = {
+	{  0,  0,  0 }, { 20, 20, 80 }, { 80, 13, 13 }, { 20, 80, 20 },
+	{ 80, 20, 80 }, { 20, 80, 80 }, { 80, 80, 20 }, { 53, 53, 53 },
+	{ 26, 26, 26 }, { 33, 33, 60 }, { 60, 26, 26 }, { 33, 60, 33 },
+	{ 60, 33, 60 }, { 33, 60, 60 }, { 60, 60, 33 }, { 80, 80, 80 },
+};
+
+/** Converts a sixel HLS color to RGB percentages.
+ * Sixel hues start at blue instead of red. */
+static void
+hls2rgb(int h, int l, int s, int *rgb)
+{
+	if (s == 0) {
+		rgb[0] = rgb[1] = rgb[2] = l;
+		return;
+	}
+
+	int q = l < 50 ? l*(100+s)/100 : l+s-(l*s)/100;
+	int p = 2*l - q;
+
+	for (int i = 0; i < 3; ++i) {
+		// Red is at 120 degrees, green at 240 and blue at 0.
+		int t = (h + 240 - i*120 + 360) % 360;
+
+		if (t < 60)		rgb[i] = p + (q-p)*t/60;
+		else if (t < 180)	rgb[i] = q;
+		else if (t < 240)	rgb[i] = p + (q-p)*(240-t)/60;
+		else			rgb[i] = p;
+	}
+}
+
+/** Marks every tile that is attached to a cell as used, and everything else
+ * as free. */
+static void
+tile_gc(struct term *term)
+{
+	memset(term->tile_used, 0, term->rows*term->cols);
+	for (int i = 0; i < term->rows*term->cols; ++i)
+		if (term->cells[i].img)
+			term->tile_used[term->cells[i].img-1] = 1;
+	term->tile_next = 0;
+}
+
+/** Returns a free tile index + 1, or 0 if out of memory. */
+static uint32_t
+tile_alloc(struct term *term)
+{
+	uint32_t n = term->rows*term->cols;
+
+	if (!term->tiles) {
+		// calloc'd memory isn't touched until an image actually
+		// covers it, so this doesn't cost much up front.
+		term->tiles = calloc(n, term->cw*term->ch);
+		term->tile_used = calloc(n, 1);
+		if (!term->tiles || !term->tile_used) {
+			free(term->tiles);
+			free(term->tile_used);
+			term->tiles = term->tile_used = NULL;
+			return 0;
+		}
+	}
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (; term->tile_next < n; ++term->tile_next) {
+			if (!term->tile_used[term->tile_next]) {
+				term->tile_used[term->tile_next] = 1;
+				return ++term->tile_next;
+			}
+		}
+
+		// Out of tiles; see which ones are not in use anymore.
+		// There is always at least one, because there is a tile for
+		// every cell and we only get here for a cell without one.
+		tile_gc(term);
+	}
+
+	return 0;
+}
+
+/** Returns the tile at row/col, attaching a new one if there is none. */
+static uint8_t *
+cell_tile(struct term *term, int row, int col)
+{
+	struct cell *cell = &term->cells[row*term->cols+col];
+	size_t sz = term->cw*term->ch;
+
+	if (!cell->img) {
+		if ((cell->img = tile_alloc(term)) == 0)
+			return NULL;
+
+		// Whatever was in the cell is replaced by the image.
+		memset(term->tiles + (cell->img-1)*sz, COLOR_GRAY(cell->bg), sz);
+		cell->c = 0;
+		cell->attr = 0;
+	}
+
+	damage_force(term, row, col);
+	return term->tiles + (cell->img-1)*sz;
+}
+
+/** Draws a horizontal line of n pixels in the current color, starting at
+ * pixel x/y of the image. */
+static void
+sixel_span(struct term *term, int x, int y, int n)
+{
+	struct sixel *s = &term->sixel;
+	int row = s->row + y/term->ch;
+
+	if (row < 0 || row > term->rows-1)
+		// Scrolled off.
+		return;
+
+	// Absolute pixel position, for dithering.
+	int ax = s->col*term->cw + x;
+	int ay = row*term->ch + y%term->ch;
+
+	while (n > 0) {
+		int col = s->col + x/term->cw;
+		if (col < 0 || col > term->cols-1)
+			// Images are clipped at the right edge.
+			break;
+
+		uint8_t *tile = cell_tile(term, row, col);
+		int off = x%term->cw;
+		int len = term->cw-off < n ? term->cw-off : n;
+
+		if (tile) {
+			tile += (y%term->ch)*term->cw + off;
+			if (COLOR_PAT(s->color) == 0)
+				memset(tile, COLOR_GRAY(s->color), len);
+			else for (int i = 0; i < len; ++i)
+				tile[i] = color_at(s->color, ax+i, ay);
+		}
+
+		x += len;
+		ax += len;
+		n -= len;
+	}
+}
+
+/** Scrolls the screen until the band of sixels at y fits on it. */
+static void
+sixel_fit(struct term *term)
+{
+	struct sixel *s = &term->sixel;
+
+	while (s->row + (s->y+5)/term->ch > term->margin_bottom) {
+		term_move(term, term->margin_bottom, term->col);
+		newline(term, 0);
+		s->row--;
+	}
+
+	if ((s->y+5)/term->ch > s->rows)
+		s->rows = (s->y+5)/term->ch;
+}
+
+static void
+sixel_start(struct term *term)
+{
+	struct sixel *s = &term->sixel;
+
+	memset(s, 0, sizeof(*s));
+	s->row = term->row;
+	s->col = term->col;
+	s->repeat = 1;
+
+	for (int i = 0; i < 16; ++i)
+		s->regs[i] = luma(
+			sixel_defaults[i][0]*255/100,
+			sixel_defaults[i][1]*255/100,
+			sixel_defaults[i][2]*255/100
+		);
+	s->color = imgmap[s->regs[0]];
+
+	sixel_fit(term);
+}
+
+/** Runs a completed '#' command. */
+static void
+sixel_color(struct term *term)
+{
+	struct sixel *s = &term->sixel;
+	int reg = s->args[0] & 0xFF;
+	int rgb[3];
+
+	if (s->narg >= 5) {
+		// Color definition.
+		if (s->args[1] == 1) {
+			hls2rgb(s->args[2] % 361, s->args[3] % 101, s->args[4] % 101, rgb);
+		} else {
+			for (int i = 0; i < 3; ++i)
+				rgb[i] = s->args[i+2] > 100 ? 100 : s->args[i+2];
+		}
+
+		s->regs[reg] = luma(rgb[0]*255/100, rgb[1]*255/100, rgb[2]*255/100);
+	}
+
+	s->color = imgmap[s->regs[reg]];
+}
+
+static void
+sixel_putc(struct term *term, rune c)
+{
+	struct sixel *s = &term->sixel;
+
+	if (s->cmd) {
+		// Collecting arguments for a command.
+		if (c >= '0' && c <= '9') {
+			if (!s->narg)
+				s->narg = 1;
+			if (s->narg <= ARRAYLEN(s->args) && s->args[s->narg-1] < 10000)
+				s->args[s->narg-1] = s->args[s->narg-1]*10 + c-'0';
+			return;
+		} else if (c == ';') {
+			s->narg++;
+			return;
+		}
+
+		// Anything else finishes the command.
+		switch (s->cmd) {
+		case '#': if (s->narg) sixel_color(term); break;
+		case '!': s->repeat = s->args[0] ? s->args[0] : 1; break;
+		case '"': break; // Raster attributes; tiles are sized lazily
+		}
+		s->cmd = 0;
+	}
+
+	switch (c) {
+	case '#': // Color introducer
+	case '!': // Repeat introducer
+	case '"': // Raster attributes
+		s->cmd = c;
+		s->narg = 0;
+		memset(s->args, 0, sizeof(s->args));
+		return;
+	case '$': // Graphics carriage return
+		s->x = 0;
+		return;
+	case '-': // Graphics new line
+		s->x = 0;
+		s->y += 6;
+		sixel_fit(term);
+		return;
+	}
+
+	if (c < '?' || c > '~')
+		// Not a sixel, and not something we care about.
+		return;
+
+	int bits = c - '?';
+	for (int i = 0; i < 6; ++i)
+		if (bits & (1 << i))
+			sixel_span(term, s->x, s->y+i, s->repeat);
+
+	// Nothing past the right edge is drawn, so there is no need to keep
+	// count of how far past it the image goes, and room for an int to
+	// overflow if it did.
+	if (s->x < (term->cols - s->col)*term->cw)
+		s->x += s->repeat;
+	s->repeat = 1;
+}
+
+/** Finishes an image and puts the cursor below it. */
+static void
+sixel_end(struct term *term)
+{
+	struct sixel *s = &term->sixel;
+
+	term_move(term, s->row + s->rows, s->col);
+	if (s->row + s->rows >= term->margin_bottom)
+		newline(term, 0);
+	else
+		term_move(term, s->row + s->rows + 1, s->col);
+}
+
+/* Handles the contents of a DCS string. */
+static void
+dcs(struct term *term, rune c)
+{
+	switch (term->esc_state) {
+	case ESC_DCS:
+		if (c < 0x40 || c > 0x7E) {
+			// Parameters and intermediates; we don't use any.
+			return;
+		}
+
+		if (c == 'q') {
+			sixel_start(term);
+			term->esc_state = ESC_SIXEL;
+		} else {
+			term->esc_state = ESC_DCSIGNORE;
+		}
+		break;
+	case ESC_SIXEL:
+		sixel_putc(term, c);
+		break;
+	}
+}
+
 static void
 apply(struct term *term, int val)
 {
@@ -274,18 +674,58 @@ apply(struct term *term, int val)
 
 	// Colors!
 	if (30 <= val && val <= 37) {
-		term->fg = colors[val-30];
+		term->fg = palette[val-30];
 	} else if (40 <= val && val <= 47) {
-		term->bg = colors[val-40];
+		term->bg = palette[val-40];
 	} else if (90 <= val && val <= 97) {
-		term->fg = colors[val-90+8];
+		term->fg = palette[val-90+8];
 	} else if (100 <= val && val <= 107) {
-		term->bg = colors[val-100+8];
+		term->bg = palette[val-100+8];
+	} else if (val == 39) {
+		term->fg = default_fg;
+	} else if (val == 49) {
+		term->bg = default_bg;
 	}
 
 	// Everything else should be silently ignored.
 }
 
+/* Handles the extended color forms of SGR, which are 38;5;n for the 256 color
+ * palette and 38;2;r;g;b for truecolor (48 for the background).
+ * args[0] is 38 or 48, and n is the number of arguments left including it.
+ *
+ * The return value is the number of arguments used after args[0].
+ */
+static int
+extcolor(struct term *term, int *args, int n)
+{
+	uint32_t color;
+	int used;
+
+	if (n >= 3 && args[1] == 5) {
+		used = 2;
+		if (args[2] > 255)
+			return used;
+		color = palette[args[2]];
+	} else if (n >= 5 && args[1] == 2) {
+		used = 4;
+		for (int i = 2; i <= 4; ++i)
+			if (args[i] > 255) args[i] = 255;
+		color = graymap[255-luma(args[2], args[3], args[4])];
+	} else {
+		// Unknown or truncated, so eat the rest of the arguments.
+		// They are not attributes and should not be treated as such.
+		return n-1;
+	}
+
+	if (args[0] == 38)
+		term->fg = color;
+	else
+		term->bg = color;
+
+	return used;
+}
+
 static void
 csi(struct term *term)
 {
@@ -366,15 +806,23 @@ csi(struct term *term)
 	case 'h': // Set mode
 		for (int i = 0; i < narg; i++) {
 			printf("request set mode: %d\n", args[i]);
-			if (args[i] == 1000)
+			if (args[i] == 1)
+				term->state |= STATE_APPCURSOR;
+			else if (args[i] == 1000)
 				term->state |= STATE_MOUSE;
+			else if (args[i] == 47 || args[i] == 1047 || args[i] == 1049)
+				term->state |= STATE_ALTSCREEN;
 		}
 		break;
 	case 'l': // Unset mode
 		for (int i = 0; i < narg; i++) {
 			printf("request unset mode: %d\n", args[i]);
-			if (args[i] == 1000)
+			if (args[i] == 1)
+				term->state &= ~(STATE_APPCURSOR);
+			else if (args[i] == 1000)
 				term->state &= ~(STATE_MOUSE);
+			else if (args[i] == 47 || args[i] == 1047 || args[i] == 1049)
+				term->state &= ~(STATE_ALTSCREEN);
 		}
 		break;
 	case 'H': // CUP; Set cursor pos
@@ -399,14 +847,17 @@ csi(struct term *term)
 				term->attr = 0;
 				term->bg = default_bg;
 				term->fg = default_fg;
+			} else if (args[i] == 38 || args[i] == 48) {
+				i += extcolor(term, &args[i], narg-i);
 			} else apply(term, args[i]);
 		}
 		break;
 	case 'n': // DSR; Device status report
 		if (args[0] == 6) {
 			// Get cursor position
-			int ret = snprintf(term->esc_buf, sizeof(term->esc_buf), "\033[%d;%dR", term->row+1, term->col+1);
-			write(term->pty, term->esc_buf, ret);
+			char reply[32];
+			int ret = snprintf(reply, sizeof(reply), "\033[%d;%dR", term->row+1, term->col+1);
+			term_send(term, reply, ret);
 		}
 		break;
 	case 'r': // DECSTBM; Set Top and Bottom Margins
@@ -425,6 +876,7 @@ csi(struct term *term)
 		if (!args[0]) args[0] = 1;
 		for (int i = term->col; i < term->cols && args[0]; i++,args[0]--) {
 			term->cells[term->row*term->cols+i].c = 0;
+			term->cells[term->row*term->cols+i].img = 0;
 			term->cells[term->row*term->cols+i].bg = term->bg;
 			term->cells[term->row*term->cols+i].fg = term->fg;
 			term->cells[term->row*term->cols+i].attr = term->attr;
@@ -442,9 +894,18 @@ csi(struct term *term)
 static void
 term_putr(struct term *term, rune c)
 {
+	// DCS strings go on until ST (ESC \\), and may contain anything.
+	if (term->esc_state >= ESC_DCS && c != '\033') {
+		dcs(term, c);
+		return;
+	}
+
 	// Check for control characters.
 	if (c <= 0x1F) {
 		if (c == '\033') {
+			if (term->esc_state == ESC_SIXEL)
+				sixel_end(term);
+
 			// Prepare for an escape code.
 			term->esc_state = ESC_START;
 			term->esc = 0;
@@ -459,6 +920,9 @@ term_putr(struct term *term, rune c)
 		if (c == '[') {
 			term->esc_state = ESC_CSI;
 			return;
+		} else if (c == 'P') {
+			term->esc_state = ESC_DCS;
+			return;
 		}
 		esc(term, c);
 		term->esc_state = ESC_NONE;
@@ -494,11 +958,13 @@ term_putr(struct term *term, rune c)
 	cell->attr = term->attr;
 	cell->bg = term->bg;
 	cell->fg = term->fg;
+	cell->img = 0;
 	damage(term, term->row, term->col);
 
 	// Wide characters have a dummy cell placed ahead of it.
 	if (wcwidth(c) == 2 && term->col+1 <= term->cols-1) {
 		term->cells[(term->cols*term->row)+term->col+1].c = 0;
+		term->cells[(term->cols*term->row)+term->col+1].img = 0;
 		term->cells[(term->cols*term->row)+term->col+1].attr = ATTR_WIDEDUMMY;
 		damage(term, term->row, term->col+1);
 	}
@@ -517,6 +983,19 @@ void
 term_flip(struct term *term)
 {
 	memmove(term->cells2, term->cells, sizeof(*term->cells)*term->rows*term->cols);
+	term->scrolled = 0;
+}
+
+void
+term_damage(struct term *term, int row, int col)
+{
+	damage(term, row, col);
+}
+
+void
+term_invalidate(struct term *term)
+{
+	memset(term->damage, 0xFF, DAMAGE_BYTES(term));
 }
 
 int
@@ -529,6 +1008,10 @@ term_init(struct term *term, int rows, int cols, int *slave)
 	assert(cols > 0);
 	assert(slave);
 
+	// Build the color tables if nobody has done so yet.
+	if (!graylevels)
+		term_set_graylevels(16, 0);
+
 	// Initialize the term struct.
 	memset(term, 0, sizeof(*term));
 
@@ -537,6 +1020,8 @@ term_init(struct term *term, int rows, int cols, int *slave)
 	term->cols = cols;
 	term->bg = default_bg;
 	term->fg = default_fg;
+	term->cw = 8;
+	term->ch = 16;
 
 	// The bottom margin is always the number of rows unless explicitly set otherwise.
 	term->margin_bottom = rows-1;
@@ -564,6 +1049,10 @@ term_init(struct term *term, int rows, int cols, int *slave)
 	if (openpty(&term->pty, slave, NULL, NULL, NULL) == -1)
 		goto fail;
 
+	// Writes are queued instead of waiting for the program to read them;
+	// see term_send.
+	fcntl(term->pty, F_SETFL, fcntl(term->pty, F_GETFL) | O_NONBLOCK);
+
 	// Set terminal size.
 	// This isn't fatal.
 	struct winsize w = {0};
@@ -607,6 +1096,22 @@ term_free(struct term *term)
 
 	if (term->cells2)
 		free(term->cells2);
+
+	if (term->tiles)
+		free(term->tiles);
+
+	if (term->tile_used)
+		free(term->tile_used);
+}
+
+void
+term_set_cellsize(struct term *term, int w, int h)
+{
+	assert(!term->tiles);
+	assert(w > 0 && h > 0);
+
+	term->cw = w;
+	term->ch = h;
 }
 
 size_t
@@ -682,6 +1187,7 @@ term_clear(struct term *term, int dir)
 			init_row(term, i);
 		for (int i = 0; i <= term->col; i++) {
 			term->cells[(term->row*term->cols)+i].c = 0;
+			term->cells[(term->row*term->cols)+i].img = 0;
 			term->cells[(term->row*term->cols)+i].bg = term->bg;
 			term->cells[(term->row*term->cols)+i].fg = term->fg;
 			term->cells[(term->row*term->cols)+i].attr = term->attr;
@@ -735,8 +1241,59 @@ term_emit_mouse_click(struct term *term, int row, int col, int btn)
 		// We do not want mouse events right now.
 		return;
 
-	int ret = snprintf(term->esc_buf, sizeof(term->esc_buf), "\x1b[<%d;%d;%dM", btn, col, row);
-	write(term->pty, term->esc_buf, ret);
-	ret = snprintf(term->esc_buf, sizeof(term->esc_buf), "\x1b[<%d;%d;%dm", btn, col, row);
-	write(term->pty, term->esc_buf, ret);
+	char report[64];
+	int ret = snprintf(report, sizeof(report), "\x1b[<%d;%d;%dM\x1b[<%d;%d;%dm", btn, col, row, btn, col, row);
+	term_send(term, report, ret);
+}
+
+size_t
+term_send(struct term *term, const void *buf, size_t n)
+{
+	const unsigned char *src = buf;
+
+	// Half of a key or a report would garble everything after it, so
+	// anything that doesn't fit once the pty has taken what it can is
+	// dropped whole.
+	if (n > SEND_BUFSZ - term->send_len)
+		term_flush(term);
+	if (n > SEND_BUFSZ - term->send_len)
+		return 0;
+
+	// Copy in at most two pieces, around the end of the ring.
+	for (size_t done = 0; done < n; ) {
+		size_t tail = (term->send_head + term->send_len) % SEND_BUFSZ;
+		size_t chunk = n - done;
+		if (chunk > SEND_BUFSZ - tail)
+			chunk = SEND_BUFSZ - tail;
+
+		memcpy(&term->send_buf[tail], src+done, chunk);
+		term->send_len += chunk;
+		done += chunk;
+	}
+
+	// Errors will come up again when the pty is read.
+	term_flush(term);
+	return n;
+}
+
+int
+term_flush(struct term *term)
+{
+	while (term->send_len) {
+		size_t chunk = term->send_len;
+		if (chunk > SEND_BUFSZ - term->send_head)
+			chunk = SEND_BUFSZ - term->send_head;
+
+		ssize_t n = write(term->pty, &term->send_buf[term->send_head], chunk);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -1;
+		}
+
+		term->send_head = (term->send_head + n) % SEND_BUFSZ;
+		term->send_len -= n;
+	}
+
+	return 0;
 }
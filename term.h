@@ -3,6 +3,9 @@
 
 #define ESC_BUFSZ 64
 
+/* Size of the queue of data on its way to the pty. */
+#define SEND_BUFSZ 4096
+
 //#define ATTR_BOLD		(1 << 0)
 //#define ATTR_LOW		(1 << 1)
 //#define ATTR_UNDERLINE	(1 << 2)
@@ -21,12 +24,31 @@
 /* Turned on when the terminal program is requesting mouse events. */
 #define STATE_MOUSE		(1 << 2)
 
+/* Turned on while the terminal program has asked for the alternate screen.
+ * There is only the one screen, but this tells full screen programs apart
+ * from a shell. */
+#define STATE_ALTSCREEN		(1 << 3)
+
+/* Turned on when the terminal program wants cursor keys to send application
+ * sequences (DECCKM). */
+#define STATE_APPCURSOR		(1 << 4)
+
+/* Colors are quantized to the panel's gray levels once, when they are set by
+ * SGR, so the renderer never has to convert anything.
+ * A color is packed as 0x00PPHHLL: LL is the gray level to use, HH is the next
+ * level up and PP is how many of the 16 cells in a 4x4 ordered dither pattern
+ * use HH instead of LL. PP is always 0 unless dithering is turned on. */
+#define COLOR_GRAY(c)		((uint8_t)((c) & 0xFF))
+#define COLOR_GRAY2(c)		((uint8_t)(((c) >> 8) & 0xFF))
+#define COLOR_PAT(c)		((uint8_t)(((c) >> 16) & 0xFF))
+
 /* Helper defines for damage tracking. */
 #define DAMAGE_WIDTH (8*sizeof(term_damage_t))
 #define DAMAGE_ROW(term, idx) ((idx)/((term)->cols))
 #define DAMAGE_COL(term, idx) ((idx)%((term)->cols))
 #define DAMAGE_BITS(term) ((term)->rows*(term)->cols)
-#define DAMAGE_BYTES(term) ((DAMAGE_BITS(term)+(sizeof(term_damage_t)))/8)
+#define DAMAGE_LEN(term) ((DAMAGE_BITS(term)+DAMAGE_WIDTH-1)/DAMAGE_WIDTH)
+#define DAMAGE_BYTES(term) (DAMAGE_LEN(term)*sizeof(term_damage_t))
 
 #include "utf8.h"
 
@@ -35,10 +57,39 @@ typedef unsigned short term_damage_t;
 
 struct cell {
 	rune c;
-	uint32_t bg, fg; // *rgb
+	uint32_t bg, fg; // See COLOR_GRAY
+	uint32_t img; // Image tile index + 1, or 0 for none
 	char attr;
 };
 
+/** State of the sixel decoder.
+ * Images are decoded as they stream in, straight into tiles of cw*ch 8-bit
+ * gray pixels that are attached to the cells they cover. */
+struct sixel {
+	/** Cell the image started at. This moves if the image scrolls. */
+	int row, col;
+
+	/** Pixel position of the next sixel, relative to row/col. */
+	int x, y;
+
+	/** Furthest row of cells the image has touched, relative to row. */
+	int rows;
+
+	/** Current color, packed like COLOR_GRAY. */
+	uint32_t color;
+
+	/** Repeat count for the next sixel. */
+	int repeat;
+
+	/** Command being parsed ('#', '!' or '"'), or 0, and its arguments. */
+	char cmd;
+	int narg;
+	int args[5];
+
+	/** Color registers, as unquantized gray values. */
+	uint8_t regs[256];
+};
+
 struct term {
 	int rows, cols;
 	int row, col;
@@ -60,11 +111,59 @@ struct term {
 	int esc;
 	int esc_state;
 
-	void (*on_bell)(void);
+	/** Size of a cell in pixels, used for images. */
+	int cw, ch;
+
+	/** Image tiles, allocated on first use.
+	 * There are at most rows*cols of them, one per cell. */
+	uint8_t *tiles;
+	uint8_t *tile_used;
+	uint32_t tile_next;
+
+	struct sixel sixel;
+
+	/** Lines scrolled since the last term_flip. */
+	int scrolled;
+
+	/** Data waiting to be written to the pty, as a ring buffer of
+	 * send_len bytes starting at send_head. See term_send. */
+	unsigned char send_buf[SEND_BUFSZ];
+	size_t send_head, send_len;
+
+	void (*on_bell)(struct term *term);
 };
 
 extern const uint32_t colors[16];
 
+/** Returns the gray level of color c at pixel x, y, applying the ordered
+ * dither pattern if there is one. */
+static inline uint8_t
+color_at(uint32_t c, int x, int y)
+{
+	// 4x4 Bayer matrix.
+	static const uint8_t bayer[4][4] = {
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 },
+	};
+
+	return bayer[y&3][x&3] < COLOR_PAT(c) ? COLOR_GRAY2(c) : COLOR_GRAY(c);
+}
+
+/** Sets the number of gray levels the panel can display and whether colors
+ * in between them should be dithered.
+ * This rebuilds the lookup tables used by SGR, and only affects colors that
+ * are set afterwards.
+ *
+ * levels must be between 2 and 256 or an assertion is raised.
+ */
+void term_set_graylevels(int levels, int dither);
+
+/** Returns the color a of the way from bg to fg, where a is 0 to 255,
+ * quantized to the panel's gray levels like colors set by SGR. */
+uint32_t term_mix(uint32_t fg, uint32_t bg, uint8_t a);
+
 /** Initializes the terminal with the number of rows and cols.
  * All data is overwritten in the passed struct.
  *
@@ -78,15 +177,40 @@ extern const uint32_t colors[16];
  */
 int term_init(struct term *term, int rows, int cols, int *slave);
 
+/** Sets the size of a cell in pixels, which is used to lay out images.
+ * term_init defaults to 8x16.
+ *
+ * This must be called before any images are shown, or an assertion is raised.
+ */
+void term_set_cellsize(struct term *term, int w, int h);
+
+/** Returns the pixels of the image tile attached to a cell, or NULL.
+ * Tiles are term->cw by term->ch 8-bit gray pixels, with no padding. */
+static inline const uint8_t *
+term_tile(struct term *term, const struct cell *cell)
+{
+	if (!cell->img)
+		return NULL;
+	return term->tiles + (size_t)(cell->img-1)*term->cw*term->ch;
+}
+
 /** Frees all related data with the term struct. */
 void term_free(struct term *term);
 
 /* Copies the content of the current state of the screen to the off-screen
- * buffer for faster damage tracking.
+ * buffer for faster damage tracking, and resets scrolled.
  * Call this after rendering has taken place.
  */
 void term_flip(struct term *term);
 
+/** Marks the entire screen as damaged, whether it changed or not.
+ * Use this when whatever is on the display no longer matches the screen. */
+void term_invalidate(struct term *term);
+
+/** Marks the cell at row/col as damaged if it differs from what was last
+ * drawn there. */
+void term_damage(struct term *term, int row, int col);
+
 /** Write data to the terminal.
  * The return value is how many bytes that were read from the input.
  *
@@ -94,6 +218,31 @@ void term_flip(struct term *term);
  */
 size_t term_write(struct term *term, unsigned char *buf, size_t n);
 
+/** Queues data to be written to the pty, and writes as much of it as can be
+ * written without blocking. The rest is written by term_flush.
+ * Everything that goes to the pty, including replies from the terminal
+ * itself, goes through here, so it stays in order.
+ *
+ * buf is queued whole or not at all, so the program never gets part of a
+ * sequence.
+ *
+ * Returns n, or 0 if there is no room for all of it.
+ */
+size_t term_send(struct term *term, const void *buf, size_t n);
+
+/** Writes as much of the queue as can be written without blocking.
+ *
+ * Returns -1 on error and sets errno. */
+int term_flush(struct term *term);
+
+/** Returns how many bytes are waiting to be written to the pty.
+ * Poll it for POLLOUT and call term_flush while this is non-zero. */
+static inline size_t
+term_pending(struct term *term)
+{
+	return term->send_len;
+}
+
 /** Move the cursor in an absolute fashion. */
 void term_move(struct term *term, int y, int x);
 
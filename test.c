@@ -8,6 +8,8 @@
 #include <poll.h>
 #include <ctype.h>
 
+#include "pool.h"
+#include "render.h"
 #include "term.h"
 #include "x.h"
 
@@ -28,14 +30,52 @@ draw(void)
 	}
 }
 
+/* Fills a region set that is as big as they come with more rectangles than
+ * it can hold, and checks that it still covers all of them. */
+static void
+check_regions(void)
+{
+	struct region_set set;
+	region_init(&set, REGION_MAX, 0, 1);
+
+	for (int i = 0; i < 4*REGION_MAX; ++i) {
+		region_add(&set, i*100, i*100, 10, 10);
+		if (set.n < 1 || set.n > REGION_MAX)
+			die("region set has %d regions, max is %d\n", set.n, REGION_MAX);
+	}
+
+	for (int i = 0; i < 4*REGION_MAX; ++i) {
+		int covered = 0;
+		for (int j = 0; j < set.n; ++j) {
+			struct region *r = &set.r[j];
+			covered |= r->x <= i*100 && r->y <= i*100 && r->x+r->w >= i*100+10 && r->y+r->h >= i*100+10;
+		}
+		if (!covered)
+			die("region set lost rectangle %d\n", i);
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
-	if (argc != 1) {
-		fprintf(stderr, "usage: %s < input > output\n", argc ? argv[0] : "./test");
+	// If set, the screen is also rendered and written out as a PGM here.
+	char *pgm = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p': pgm = optarg; break;
+		default: optind = argc+1; break;
+		}
+	}
+
+	if (optind != argc) {
+		fprintf(stderr, "usage: %s [-p out.pgm] < input > output\n", argc ? argv[0] : "./test");
 		exit(EXIT_FAILURE);
 	}
 
+	check_regions();
+
 	int slave;
 	assert(term_init(&term, 10, 20, &slave) != -1);
 	// close(slave); // We don't actually need it
@@ -61,5 +101,32 @@ main(int argc, char *argv[])
 	// Intentionally wait to draw until here
 	draw();
 
+	if (pgm) {
+		struct renderer *r = render_mem_new(term.rows, term.cols, term.cw, term.ch);
+		FILE *f = fopen(pgm, "wb");
+		assert(r && f);
+
+		render_draw(r, &term);
+		if (render_mem_dump(r, f) == -1)
+			die("failed to write %s: %s\n", pgm, strerror(errno));
+
+		// Drawing on several threads has to come out the same.
+		struct renderer *pr = render_mem_new(term.rows, term.cols, term.cw, term.ch);
+		assert(pr);
+		pr->pool = pool_new(4);
+		assert(pr->pool);
+
+		term_invalidate(&term);
+		render_draw(pr, &term);
+		if (memcmp(render_mem_pixels(pr), render_mem_pixels(r), r->width*r->height))
+			die("drawing with a pool differs from drawing without\n");
+
+		pool_free(pr->pool);
+		pr->free(pr);
+
+		fclose(f);
+		r->free(r);
+	}
+
 	term_free(&term);
 }